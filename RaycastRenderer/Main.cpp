@@ -2,589 +2,6229 @@
 #include <SDL_mixer.h>
 #include <SDL_ttf.h>
 #include <stdio.h>
+#include <cctype>
 #include <cmath>
 #include <string>
 #include <vector>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <cstring>
+#include <deque>
+#include <map>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
 
-#define mapWidth 25
-#define mapHeight 25
-#define screenWidth 640
-#define screenHeight 640
-#define renderHeight 480
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Window and viewport size, see setResolution()
+int screenWidth = 640;
+int screenHeight = 640;
+int viewHeight = 480;
+const int hudHeight = 160;
+
+// Size the 3D view is rendered at before it is scaled to the viewport, see setRenderScale()
+int renderWidth = 640;
+int renderHeight = 480;
+double renderScale = 1.0;
 
 #define texWidth 64
 #define texHeight 64
 
-int worldMap[mapWidth][mapHeight];
+// Cell grid of the loaded map. X runs down the rows of the map file and Y along each row.
+// Cells are stored in 8x8 tiles so a DDA walk in any direction stays on a few cache lines.
+// Next to the cells it keeps the empty radius of every cell, the Chebyshev distance to the
+// nearest wall or the map edge, which lets the DDA jump across open space, and the floor and
+// ceiling texture of every cell.
+class TileMap
+{
+public:
+    static const int tileShift = 3;
+    static const int tileSize = 1 << tileShift;
+    static const int tileMask = tileSize - 1;
+
+    // Bytes needed for a map of this size. Padding lets the SIMD gathers read a whole 32 bits at the last cell
+    static size_t storageSize(int width, int height)
+    {
+        size_t tilesX = (width + tileMask) >> tileShift;
+        size_t tilesY = (height + tileMask) >> tileShift;
+        return tilesX * tilesY * tileSize * tileSize + sizeof(Uint32);
+    }
+
+    // All cells empty. The empty radius is left at 0 until rebuildEmptyRadius(), which is
+    // always safe, it only means no skipping.
+    void resize(int newWidth, int newHeight)
+    {
+        mapWidth = newWidth;
+        mapHeight = newHeight;
+        tilesY = (newHeight + tileMask) >> tileShift;
+
+        storage.assign(storageSize(newWidth, newHeight), 0);
+        radiusStorage.assign(storage.size(), 0);
+        floorStorage.assign(storage.size(), 0);
+        ceilingStorage.assign(storage.size(), 0);
+        cells = storage.data();
+        radius = radiusStorage.data();
+        floorIds = floorStorage.data();
+        ceilingIds = ceilingStorage.data();
+        texturedSurfaces = false;
+    }
+
+    // Uses cells laid out by storageSize()/index() in place, e.g. straight from a mapped map file,
+    // and a precomputed empty radius and floor and ceiling layers in the same layout when there are.
+    // The memory has to stay valid and writable until the next resize() or adopt().
+    void adopt(int newWidth, int newHeight, Uint8* data, Uint8* emptyRadiusData, Uint8* floorData, Uint8* ceilingData)
+    {
+        mapWidth = newWidth;
+        mapHeight = newHeight;
+        tilesY = (newHeight + tileMask) >> tileShift;
+
+        storage.clear();
+        storage.shrink_to_fit();
+        cells = data;
+
+        if (emptyRadiusData)
+        {
+            radiusStorage.clear();
+            radiusStorage.shrink_to_fit();
+            radius = emptyRadiusData;
+        }
+        else
+        {
+            radiusStorage.assign(storageSize(newWidth, newHeight), 0);
+            radius = radiusStorage.data();
+            rebuildEmptyRadius();
+        }
+
+        size_t size = storageSize(newWidth, newHeight);
+        floorStorage.assign(floorData ? 0 : size, 0);
+        ceilingStorage.assign(ceilingData ? 0 : size, 0);
+        floorIds = floorData ? floorData : floorStorage.data();
+        ceilingIds = ceilingData ? ceilingData : ceilingStorage.data();
+        texturedSurfaces = (floorData && std::any_of(floorData, floorData + size, [](Uint8 id) { return id != 0; }))
+            || (ceilingData && std::any_of(ceilingData, ceilingData + size, [](Uint8 id) { return id != 0; }));
+    }
+
+    int width() const { return mapWidth; }
+    int height() const { return mapHeight; }
+    int tileColumns() const { return tilesY; }
+
+    bool contains(int x, int y) const { return (unsigned)x < (unsigned)mapWidth && (unsigned)y < (unsigned)mapHeight; }
+
+    int index(int x, int y) const
+    {
+        return (((x >> tileShift) * tilesY + (y >> tileShift)) << (2 * tileShift)) | ((x & tileMask) << tileShift) | (y & tileMask);
+    }
+
+    // Unchecked, the caller makes sure the cell is inside the map
+    Uint8 at(int x, int y) const { return cells[index(x, y)]; }
+
+    // Cells outside the map read as solid wall
+    Uint8 cell(int x, int y) const { return contains(x, y) ? at(x, y) : 1; }
+
+    // Every cell closer than this (in both axes) to an empty cell is empty too, 0 for walls.
+    // Stored values may be lower than the exact distance, never higher.
+    Uint8 emptyRadius(int x, int y) const { return radius[index(x, y)]; }
+
+    void set(int x, int y, Uint8 value)
+    {
+        int i = index(x, y);
+        bool wasEmpty = cells[i] == 0;
+        cells[i] = value;
+        if (wasEmpty == (value == 0)) return;
+
+        if (value != 0)
+        {
+            // A new wall can only bring cells closer to a wall, clamp everything it is now near to
+            radius[i] = 0;
+            int reach = std::min(maxEmptyRadius, std::max(mapWidth, mapHeight));
+            for (int cx = std::max(0, x - reach); cx <= std::min(mapWidth - 1, x + reach); cx++)
+            {
+                for (int cy = std::max(0, y - reach); cy <= std::min(mapHeight - 1, y + reach); cy++)
+                {
+                    Uint8& r = radius[index(cx, cy)];
+                    int distance = std::max(std::abs(cx - x), std::abs(cy - y));
+                    if (r > distance) r = (Uint8)distance;
+                }
+            }
+        }
+        else
+        {
+            // An opened cell is one further than its closest neighbour. The cells around it keep their
+            // old, now possibly too low, radius until the next rebuild.
+            int nearest = maxEmptyRadius;
+            for (int dx = -1; dx <= 1; dx++)
+            {
+                for (int dy = -1; dy <= 1; dy++)
+                {
+                    if (dx == 0 && dy == 0) continue;
+                    nearest = std::min(nearest, contains(x + dx, y + dy) ? (int)emptyRadius(x + dx, y + dy) : 0);
+                }
+            }
+            radius[i] = (Uint8)std::min(nearest + 1, maxEmptyRadius);
+        }
+    }
+
+    // Whether the empty radius is safe to skip by: 0 on walls, and nowhere more than one above the
+    // smallest of the 8 neighbours, with cells outside the map counting as 0
+    bool emptyRadiusValid() const
+    {
+        for (int x = 0; x < mapWidth; x++)
+        {
+            for (int y = 0; y < mapHeight; y++)
+            {
+                int r = emptyRadius(x, y);
+                if (r == 0) continue;
+                if (at(x, y) != 0) return false;
+                for (int dx = -1; dx <= 1; dx++)
+                {
+                    for (int dy = -1; dy <= 1; dy++)
+                    {
+                        int neighbour = contains(x + dx, y + dy) ? (int)emptyRadius(x + dx, y + dy) : 0;
+                        if (r > neighbour + 1) return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    // Exact Chebyshev distance transform, a forward and a backward pass over the 8 neighbours
+    void rebuildEmptyRadius()
+    {
+        std::vector<Uint8> distance((size_t)mapWidth * mapHeight);
+        auto at = [&](int x, int y) { return contains(x, y) ? (int)distance[(size_t)x * mapHeight + y] : 0; };
+
+        for (int x = 0; x < mapWidth; x++)
+        {
+            for (int y = 0; y < mapHeight; y++)
+            {
+                int nearest = 0;
+                if (this->at(x, y) == 0)
+                {
+                    nearest = std::min(std::min(at(x - 1, y - 1), at(x - 1, y)), std::min(at(x - 1, y + 1), at(x, y - 1))) + 1;
+                }
+                distance[(size_t)x * mapHeight + y] = (Uint8)std::min(nearest, maxEmptyRadius);
+            }
+        }
+        for (int x = mapWidth - 1; x >= 0; x--)
+        {
+            for (int y = mapHeight - 1; y >= 0; y--)
+            {
+                Uint8& nearest = distance[(size_t)x * mapHeight + y];
+                int other = std::min(std::min(at(x + 1, y + 1), at(x + 1, y)), std::min(at(x + 1, y - 1), at(x, y + 1))) + 1;
+                if (other < nearest) nearest = (Uint8)other;
+                radius[index(x, y)] = nearest;
+            }
+        }
+    }
+
+    // Indices into wallTextures, 0 leaves the flat floor or ceiling colour
+    Uint8 floorTexture(int x, int y) const { return floorIds[index(x, y)]; }
+    Uint8 ceilingTexture(int x, int y) const { return ceilingIds[index(x, y)]; }
+
+    void setFloorTexture(int x, int y, Uint8 id)
+    {
+        floorIds[index(x, y)] = id;
+        if (id != 0) texturedSurfaces = true;
+    }
+
+    void setCeilingTexture(int x, int y, Uint8 id)
+    {
+        ceilingIds[index(x, y)] = id;
+        if (id != 0) texturedSurfaces = true;
+    }
+
+    // Gives every flat floor or ceiling cell a texture, 0 leaves them flat
+    void fillFlatSurfaces(Uint8 floorId, Uint8 ceilingId)
+    {
+        for (int x = 0; x < mapWidth; x++)
+        {
+            for (int y = 0; y < mapHeight; y++)
+            {
+                if (floorId != 0 && floorTexture(x, y) == 0) setFloorTexture(x, y, floorId);
+                if (ceilingId != 0 && ceilingTexture(x, y) == 0) setCeilingTexture(x, y, ceilingId);
+            }
+        }
+    }
+
+    // False when the floor and ceiling are flat everywhere and the row pass can be skipped
+    bool hasSurfaceTextures() const { return texturedSurfaces; }
+
+    const Uint8* data() const { return cells; }
+    const Uint8* emptyRadiusData() const { return radius; }
+    const Uint8* floorData() const { return floorIds; }
+    const Uint8* ceilingData() const { return ceilingIds; }
+
+    static const int maxEmptyRadius = 255;
+
+private:
+    int mapWidth = 0;
+    int mapHeight = 0;
+    int tilesY = 0;
+    Uint8* cells = nullptr;
+    Uint8* radius = nullptr;
+    Uint8* floorIds = nullptr;
+    Uint8* ceilingIds = nullptr;
+    bool texturedSurfaces = false;
+    std::vector<Uint8> storage;
+    std::vector<Uint8> radiusStorage;
+    std::vector<Uint8> floorStorage;
+    std::vector<Uint8> ceilingStorage;
+};
+
+const int TileMap::maxEmptyRadius;
+
+TileMap worldMap;
+
+// Potentially visible sets. For every open cell a row of bits, one per map cell, set for the
+// cells that can be seen from somewhere inside it. A cell counts as seen when any straight line
+// from a point of one cell to a point of the other passes only through open cells (precise
+// permissive field of view), which is never stricter than a ray, so a clear bit means no ray
+// from the source cell can reach the other cell at all. Walls and doors block sight and are
+// seen themselves, their own rows stay empty. Bits are laid out x * height + y.
+class VisibilitySets
+{
+public:
+    // Rows grow with the square of the map, bigger maps get no sets and everything counts as seen
+    static const int maxCells = 8192;
+
+    void build(const TileMap& map)
+    {
+        mapWidth = map.width();
+        mapHeight = map.height();
+        int cells = mapWidth * mapHeight;
+        if (cells > maxCells)
+        {
+            printf("Map has %d cells, no visibility sets above %d\n", cells, maxCells);
+            rowWords = 0;
+            rows.clear();
+            return;
+        }
+
+        rowWords = (cells + 63) / 64;
+        rows.assign((size_t)cells * rowWords, 0);
+        for (int x = 0; x < mapWidth; x++)
+        {
+            for (int y = 0; y < mapHeight; y++)
+            {
+                if (map.at(x, y) == 0) computeRow(map, x, y);
+            }
+        }
+
+        // Masks for spreading rows along y without wrapping into the next column
+        notFirstY.assign(rowWords, 0);
+        notLastY.assign(rowWords, 0);
+        for (int i = 0; i < cells; i++)
+        {
+            if (i % mapHeight != 0) notFirstY[i >> 6] |= Uint64(1) << (i & 63);
+            if (i % mapHeight != mapHeight - 1) notLastY[i >> 6] |= Uint64(1) << (i & 63);
+        }
+    }
+
+    // Brings the sets up to date after map.set(x, y, ...). Only cells that could see the changed
+    // cell or one of its neighbours before can gain or lose sight through it, so only their rows
+    // are traced again.
+    void update(const TileMap& map, int x, int y)
+    {
+        if (!enabled() || !map.contains(x, y)) return;
+
+        std::vector<Uint64> affected(rowWords, 0);
+        for (int dx = -1; dx <= 1; dx++)
+        {
+            for (int dy = -1; dy <= 1; dy++)
+            {
+                if (!map.contains(x + dx, y + dy)) continue;
+                const Uint64* seen = row(x + dx, y + dy);
+                for (int w = 0; w < rowWords; w++) affected[w] |= seen[w];
+            }
+        }
+        int changed = x * mapHeight + y;
+        affected[changed >> 6] |= Uint64(1) << (changed & 63);
+
+        for (int w = 0; w < rowWords; w++)
+        {
+            for (Uint64 bits = affected[w]; bits; bits &= bits - 1)
+            {
+                int cell = w * 64 + ctz64(bits);
+                int cellX = cell / mapHeight, cellY = cell % mapHeight;
+                if (map.at(cellX, cellY) == 0) computeRow(map, cellX, cellY);
+                else std::fill(rowAt(cell), rowAt(cell) + rowWords, 0);
+            }
+        }
+    }
+
+    bool enabled() const { return rowWords != 0; }
+    int wordsPerRow() const { return rowWords; }
+
+    // Unchecked, the caller makes sure the cell is inside the map
+    const Uint64* row(int x, int y) const { return &rows[(size_t)(x * mapHeight + y) * rowWords]; }
+
+    static bool test(const Uint64* bits, int cell) { return (bits[cell >> 6] >> (cell & 63)) & 1; }
+
+    // False only when no line from the first cell reaches the second. Cells outside the map
+    // count as seen, so callers fall back to their own tests.
+    bool visible(int fromX, int fromY, int toX, int toY) const
+    {
+        if (!enabled() || (unsigned)fromX >= (unsigned)mapWidth || (unsigned)fromY >= (unsigned)mapHeight
+            || (unsigned)toX >= (unsigned)mapWidth || (unsigned)toY >= (unsigned)mapHeight) return true;
+        return test(row(fromX, fromY), toX * mapHeight + toY);
+    }
+
+    // The row of (x, y) grown by reach cells in every direction (Chebyshev), for things that
+    // stick out of their own cell. False when there is no row to give, e.g. outside the map.
+    bool spreadRow(int x, int y, int reach, std::vector<Uint64>& out, std::vector<Uint64>& scratch) const
+    {
+        if (!enabled() || (unsigned)x >= (unsigned)mapWidth || (unsigned)y >= (unsigned)mapHeight) return false;
+
+        const Uint64* seen = row(x, y);
+        out.assign(seen, seen + rowWords);
+        scratch.resize(rowWords);
+        int n = rowWords;
+        int wordShift = mapHeight >> 6, bitShift = mapHeight & 63;
+        Uint64 lastWord = ((mapWidth * mapHeight) & 63) ? (Uint64(1) << ((mapWidth * mapHeight) & 63)) - 1 : ~Uint64(0);
+        for (int step = 0; step < reach; step++)
+        {
+            // Along y, one bit up and down
+            for (int w = 0; w < n; w++)
+            {
+                Uint64 up = (out[w] << 1) | (w > 0 ? out[w - 1] >> 63 : 0);
+                Uint64 down = (out[w] >> 1) | (w + 1 < n ? out[w + 1] << 63 : 0);
+                scratch[w] = out[w] | (up & notFirstY[w]) | (down & notLastY[w]);
+            }
+            // Along x, one column (mapHeight bits) up and down
+            for (int w = 0; w < n; w++)
+            {
+                Uint64 bits = scratch[w];
+                int from = w - wordShift;
+                if (from >= 0) bits |= (scratch[from] << bitShift) | (bitShift && from > 0 ? scratch[from - 1] >> (64 - bitShift) : 0);
+                from = w + wordShift;
+                if (from < n) bits |= (scratch[from] >> bitShift) | (bitShift && from + 1 < n ? scratch[from + 1] << (64 - bitShift) : 0);
+                out[w] = bits;
+            }
+            out[n - 1] &= lastWord;
+        }
+        return true;
+    }
+
+private:
+    // Corner of a cell relative to the source cell's lower corner, in one quadrant
+    struct Offset
+    {
+        int x;
+        int y;
+    };
+
+    struct SightLine
+    {
+        Offset nearPoint;
+        Offset farPoint;
+
+        // Positive when p is above the line, negative below
+        long long relativeSlope(Offset p) const
+        {
+            return (long long)(farPoint.y - nearPoint.y) * (farPoint.x - p.x) - (long long)(farPoint.y - p.y) * (farPoint.x - nearPoint.x);
+        }
+        bool isBelow(Offset p) const { return relativeSlope(p) > 0; }
+        bool isBelowOrContains(Offset p) const { return relativeSlope(p) >= 0; }
+        bool isAbove(Offset p) const { return relativeSlope(p) < 0; }
+        bool isAboveOrContains(Offset p) const { return relativeSlope(p) <= 0; }
+        bool contains(Offset p) const { return relativeSlope(p) == 0; }
+    };
+
+    // Corners that bent a field's edge, chained back through the earlier bumps of the same edge
+    struct Bump
+    {
+        Offset location;
+        int parent;
+    };
+
+    // Wedge of lines from the source cell that is still open
+    struct Field
+    {
+        SightLine steep;
+        SightLine shallow;
+        int steepBump;
+        int shallowBump;
+    };
+
+    static int ctz64(Uint64 bits)
+    {
+        int n = 0;
+        while (!(bits & 1))
+        {
+            bits >>= 1;
+            n++;
+        }
+        return n;
+    }
+
+    Uint64* rowAt(int cell) { return &rows[(size_t)cell * rowWords]; }
+
+    void computeRow(const TileMap& map, int x, int y)
+    {
+        Uint64* seen = rowAt(x * mapHeight + y);
+        std::fill(seen, seen + rowWords, 0);
+        markSeen(seen, x, y);
+        for (int quadrant = 0; quadrant < 4; quadrant++)
+        {
+            int signX = (quadrant & 1) ? -1 : 1;
+            int signY = (quadrant & 2) ? -1 : 1;
+            computeQuadrant(map, x, y, signX, signY, seen);
+        }
+    }
+
+    void markSeen(Uint64* seen, int x, int y) const
+    {
+        int cell = x * mapHeight + y;
+        seen[cell >> 6] |= Uint64(1) << (cell & 63);
+    }
+
+    // Walks the quadrant one diagonal at a time, from the shallow edge to the steep edge, narrowing
+    // and splitting the open fields at every blocked cell
+    void computeQuadrant(const TileMap& map, int sourceX, int sourceY, int signX, int signY, Uint64* seen)
+    {
+        int extentX = signX > 0 ? mapWidth - 1 - sourceX : sourceX;
+        int extentY = signY > 0 ? mapHeight - 1 - sourceY : sourceY;
+        int reach = extentX + extentY + 2;
+
+        fields.clear();
+        bumps.clear();
+        fields.push_back({ { { 1, 0 }, { 0, reach } }, { { 0, 1 }, { reach, 0 } }, -1, -1 });
+
+        for (int i = 1; i <= extentX + extentY && !fields.empty(); i++)
+        {
+            size_t current = 0;
+            for (int j = std::max(0, i - extentX); j <= std::min(i, extentY) && current < fields.size(); j++)
+            {
+                int dx = i - j, dy = j;
+                Offset topLeft = { dx, dy + 1 };
+                Offset bottomRight = { dx + 1, dy };
+
+                while (current < fields.size() && fields[current].steep.isBelowOrContains(bottomRight)) current++;
+                if (current == fields.size()) break;
+                if (fields[current].shallow.isAboveOrContains(topLeft)) continue;
+
+                int cellX = sourceX + signX * dx, cellY = sourceY + signY * dy;
+                markSeen(seen, cellX, cellY);
+                if (map.at(cellX, cellY) == 0) continue;
+
+                Field& field = fields[current];
+                bool shallowSide = field.shallow.isAbove(bottomRight);
+                bool steepSide = field.steep.isBelow(topLeft);
+                if (shallowSide && steepSide)
+                {
+                    // Fills the whole field
+                    fields.erase(fields.begin() + current);
+                }
+                else if (shallowSide)
+                {
+                    addShallowBump(topLeft, field);
+                    if (collapsed(field)) fields.erase(fields.begin() + current);
+                }
+                else if (steepSide)
+                {
+                    addSteepBump(bottomRight, field);
+                    if (collapsed(field)) fields.erase(fields.begin() + current);
+                }
+                else
+                {
+                    // In the middle, the field splits into a shallower and a steeper part
+                    Field copy = field;
+                    fields.insert(fields.begin() + current, copy);
+                    size_t steeper = current + 1;
+                    addSteepBump(bottomRight, fields[current]);
+                    if (collapsed(fields[current]))
+                    {
+                        fields.erase(fields.begin() + current);
+                        steeper--;
+                    }
+                    addShallowBump(topLeft, fields[steeper]);
+                    if (collapsed(fields[steeper])) fields.erase(fields.begin() + steeper);
+                    current = steeper;
+                }
+            }
+        }
+    }
+
+    void addShallowBump(Offset point, Field& field)
+    {
+        field.shallow.farPoint = point;
+        bumps.push_back({ point, field.shallowBump });
+        field.shallowBump = (int)bumps.size() - 1;
+        for (int b = field.steepBump; b >= 0; b = bumps[b].parent)
+        {
+            if (field.shallow.isAbove(bumps[b].location)) field.shallow.nearPoint = bumps[b].location;
+        }
+    }
+
+    void addSteepBump(Offset point, Field& field)
+    {
+        field.steep.farPoint = point;
+        bumps.push_back({ point, field.steepBump });
+        field.steepBump = (int)bumps.size() - 1;
+        for (int b = field.shallowBump; b >= 0; b = bumps[b].parent)
+        {
+            if (field.steep.isBelow(bumps[b].location)) field.steep.nearPoint = bumps[b].location;
+        }
+    }
+
+    // A field squeezed down to a line through a corner of the source cell lets nothing through
+    static bool collapsed(const Field& field)
+    {
+        return field.shallow.contains(field.steep.nearPoint) && field.shallow.contains(field.steep.farPoint)
+            && (field.shallow.contains({ 0, 1 }) || field.shallow.contains({ 1, 0 }));
+    }
+
+    int mapWidth = 0;
+    int mapHeight = 0;
+    int rowWords = 0;
+    std::vector<Uint64> rows;
+    std::vector<Uint64> notFirstY;
+    std::vector<Uint64> notLastY;
+    std::vector<Field> fields;
+    std::vector<Bump> bumps;
+};
+
+const int VisibilitySets::maxCells;
+
+VisibilitySets visibilitySets;
+
+// Start and end of one line of sight question
+struct SightQuery
+{
+    double fromX, fromY;
+    double toX, toY;
+};
+
+// True when the segment between the two points crosses no wall or door. Walks the cells the
+// segment passes like traceHitscan(), stopping at the end point's cell.
+bool traceSight(const TileMap& map, const SightQuery& query)
+{
+    int mapX = (int)std::floor(query.fromX);
+    int mapY = (int)std::floor(query.fromY);
+    int endX = (int)std::floor(query.toX);
+    int endY = (int)std::floor(query.toY);
+    if (map.cell(mapX, mapY) != 0) return false;
+
+    // Distances are in fractions of the segment, past 1 the end point is reached
+    double dirX = query.toX - query.fromX;
+    double dirY = query.toY - query.fromY;
+    double deltaDistX = dirX == 0 ? 1e30 : std::fabs(1 / dirX);
+    double deltaDistY = dirY == 0 ? 1e30 : std::fabs(1 / dirY);
+    int stepX = dirX < 0 ? -1 : 1;
+    int stepY = dirY < 0 ? -1 : 1;
+    double sideDistX = (dirX < 0 ? query.fromX - mapX : mapX + 1.0 - query.fromX) * deltaDistX;
+    double sideDistY = (dirY < 0 ? query.fromY - mapY : mapY + 1.0 - query.fromY) * deltaDistY;
+
+    while (mapX != endX || mapY != endY)
+    {
+        if (sideDistX < sideDistY)
+        {
+            if (sideDistX > 1) break;
+            sideDistX += deltaDistX;
+            mapX += stepX;
+        }
+        else
+        {
+            if (sideDistY > 1) break;
+            sideDistY += deltaDistY;
+            mapY += stepY;
+        }
+        if (map.cell(mapX, mapY) != 0) return false;
+    }
+    return true;
+}
+
+// Answers many line of sight questions at once, 1 in results where nothing solid is in between.
+// Pairs whose cells can't see each other at all are answered from the visibility sets, only the
+// rest walk the map. Returns how many had to walk it.
+int checkSight(const TileMap& map, const VisibilitySets& visibility, const SightQuery* queries, Uint8* results, int count)
+{
+    int traced = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const SightQuery& query = queries[i];
+        if (!visibility.visible((int)std::floor(query.fromX), (int)std::floor(query.fromY), (int)std::floor(query.toX), (int)std::floor(query.toY)))
+        {
+            results[i] = 0;
+            continue;
+        }
+        results[i] = traceSight(map, query) ? 1 : 0;
+        traced++;
+    }
+    return traced;
+}
+
+// Rays that travel further than this stop without hitting anything
+double maxRayDistance = 1e30;
+
+// Floor and ceiling textures for cells a map leaves flat, 0 keeps the flat colours
+int defaultFloorTexture = 0;
+int defaultCeilingTexture = 0;
+
+SDL_Window* window = NULL;
+SDL_Surface* screenSurface = NULL;
+SDL_Surface* frameSurface = NULL; // What the current frame is drawn into, see PresentChain
+
+// Player as seen by the renderer, written from simulation snapshots by applyGameState()
+double posX = 2, posY = 2;
+double dirX = -1, dirY = 0;
+double planeX = 0, planeY = 0.66;
+double moveSpeed = 1.8f;
+double rotSpeed = 0.8f;
+
+// Run of opaque rows [start, end) in one texture column
+struct Span
+{
+    Uint16 start;
+    Uint16 end;
+};
+
+// Texels packed in the exact pixel format of screenSurface, converted once at load time
+struct Texture
+{
+    int w = 0;
+    int h = 0;
+    std::vector<Uint32> pixels;
+
+    // Every distinct texel, sorted. Walls and sprites both draw through it
+    std::vector<Uint32> palette;
+
+    // Wall textures only, see buildColormap()
+    std::vector<Uint16> mips; // Palette indices column by column, full size first and then each half size level down to 1x1
+    std::vector<int> mipOffsets; // First index of each level in mips
+    std::vector<Uint32> colormap; // [lightLevel][side][paletteIndex]
+
+    // Sprite textures only, see buildSpans()
+    std::vector<Uint16> columns; // Palette indices column by column
+    std::vector<Uint32> spriteShades; // [lightLevel][paletteIndex]
+    const Uint32* shadedPalette(int level) const { return spriteShades.data() + (size_t)level * palette.size(); }
+    std::vector<int> spanOffsets; // First span of each column, plus one past the last column
+    std::vector<Span> spans;
+};
+
+// Distance fog, in the style of Doom colormaps every texture gets a pre-shaded copy of its
+// palette for each light level and wall side
+const int lightLevels = 32;
+const double fogDistance = 20.0; // Walls this far away or further are fully faded
+
+const int wallTextureSize = 64;
+const int wallTypes = 10; // Must always be 1 higher than the actual amount of tile textures, as air (0) counts as a wall type
+std::shared_ptr<Texture> wallTextures[wallTypes]; // Held by the loaded level, see AssetCache
+
+// Half the width of a sprite's billboard, which is one cell wide at any distance
+const double spriteRadius = 0.5;
+
+int spriteTypes = 8;
+const int deadSpriteTexture = 8;
+
+std::shared_ptr<Texture> spriteTextures[255];
+
+enum EntityState
+{
+    ENTITY_IDLE,
+    ENTITY_MOVING,
+    ENTITY_DEAD
+};
+
+// Sprites in the world as parallel arrays, so the update and projection passes only stream the
+// fields they use. Grows with the map, there is no fixed limit.
+struct EntityStore
+{
+    std::vector<double> x;
+    std::vector<double> y;
+    std::vector<double> velocityX; // Cells per deltaTime unit
+    std::vector<double> velocityY;
+    std::vector<Uint16> texture; // Index into spriteTextures, 0 draws nothing
+    std::vector<Uint8> state;
+    std::vector<Uint8> seesPlayer; // Enemies only, refreshed every tick by updateAwareness()
+
+    int size() const { return (int)x.size(); }
+
+    void clear()
+    {
+        x.clear(); y.clear();
+        velocityX.clear(); velocityY.clear();
+        texture.clear(); state.clear();
+        seesPlayer.clear();
+    }
+
+    int add(double positionX, double positionY, int textureId)
+    {
+        x.push_back(positionX); y.push_back(positionY);
+        velocityX.push_back(0); velocityY.push_back(0);
+        texture.push_back((Uint16)textureId);
+        state.push_back(ENTITY_IDLE);
+        seesPlayer.push_back(0);
+        return size() - 1;
+    }
+
+    const Texture* textureOf(int index) const { return spriteTextures[texture[index]].get(); }
+};
+
+// The loaded level's entities, and while playing the interpolated ones the renderer draws
+EntityStore entities;
+
+// Game time advances in fixed ticks, in the units the main loop always used for deltaTime (seconds * 3)
+const int simTickRate = 60;
+const double simTickDelta = 3.0 / simTickRate;
+const int maxTicksPerFrame = 8; // Past this the game slows down rather than falling further behind
+
+// Controls for the next tick. Shots are counted so a tap shorter than a tick still fires.
+struct InputState
+{
+    bool forward = false;
+    bool backward = false;
+    bool turnLeft = false;
+    bool turnRight = false;
+    int shots = 0;
+};
+
+// Everything the simulation changes. The renderer only sees copies of it, see Simulation.
+// The map is shared read-only, nothing edits it while the game runs.
+struct GameState
+{
+    Uint64 tick = 0;
+
+    double posX = 2, posY = 2;
+    double dirX = -1, dirY = 0;
+    double planeX = 0, planeY = 0.66;
+
+    int gunOffsetX = 0;
+    int gunOffsetY = 0;
+    bool gunSwayRight = true;
+    int gunTexture = 0;
+    int faceTexture = 0;
+
+    bool canFire = true;
+    double fireCooldown = 1.0;
+    Uint32 shotsFired = 0; // The render side plays the fire sound when this goes up
+    int ammo = 100;
+    int health = 100;
+
+    EntityStore entities;
+};
+
+// HUD
+SDL_Surface* uibg;
+
+int numGuns = 1;
+SDL_Surface* gunTextures[255];
+int gunTexture = 0;
+
+int gunOffsetX = 0;
+int gunOffsetY = 0;
+
+int numFaces = 1;
+SDL_Surface* faceTextures[255];
+int faceTexture = 0;
+
+int ammo = 100;
+int health = 100;
+
+// FRAME LAYERS
+// Frames are composited from layers that are only redrawn when what they show changes. The view
+// layer is the 3D view at window size without the gun or the overlay, so a view that hasn't moved
+// is copied instead of cast again. The HUD layer is uibg with the face already on it.
+SDL_Surface* viewLayer = NULL;
+SDL_Surface* hudLayer = NULL;
+Uint64 viewVersion = 0; // Goes up every time the view layer is drawn
+Uint64 hudVersion = 0; // Goes up every time the face or a counter in the HUD layer changes
+int hudFace = -1;
+
+bool viewInvalid = true; // Set when the view has to be drawn again for reasons the camera and sprites don't show, like a new map
+bool fullRedraw = false; // --full-redraw, draws and presents every frame whole
+
+TTF_Font* font = NULL;
+TTF_Font* overlayFont = NULL;
+
+// AUDIO
+Mix_Music* music = NULL;
+Mix_Chunk* fire = NULL;
+
+// PROFILING
+enum ProfileStage
+{
+    STAGE_WALL_CAST,
+    STAGE_FLOOR_CAST,
+    STAGE_SPRITE_SORT,
+    STAGE_SPRITE_DRAW,
+    STAGE_UPSCALE,
+    STAGE_UI,
+    STAGE_PRESENT,
+    STAGE_INPUT,
+    STAGE_SIMULATE,
+    STAGE_COUNT
+};
+
+const char* stageNames[STAGE_COUNT] = { "wall cast", "floor cast", "sprite sort", "sprite draw", "upscale", "UI composite", "present", "input", "simulation" };
+
+// Measurements for one frame, stage start times are relative to the start of the frame
+struct FrameRecord
+{
+    Uint64 frame = 0;
+    double startMs = 0;
+    double frameMs = 0;
+    double stageStartMs[STAGE_COUNT] = {};
+    double stageMs[STAGE_COUNT] = {};
+    Uint64 ddaSteps = 0;
+    Uint64 texelsSampled = 0;
+    Uint64 spritesCulled = 0;
+    double renderScale = 1.0;
+};
+
+// Fixed-size ring of the most recent frame records. Only the main thread pushes, the write
+// count is published with release ordering so other threads can read without a lock.
+class FrameHistory
+{
+public:
+    static const int capacity = 1024;
+
+    void push(const FrameRecord& record)
+    {
+        Uint64 index = written.load(std::memory_order_relaxed);
+        records[index % capacity] = record;
+        written.store(index + 1, std::memory_order_release);
+    }
+
+    // Copies up to maxCount of the newest records into out, oldest first
+    int snapshot(FrameRecord* out, int maxCount) const
+    {
+        Uint64 end = written.load(std::memory_order_acquire);
+        Uint64 available = std::min<Uint64>(end, capacity);
+        int count = (int)std::min<Uint64>(available, (Uint64)maxCount);
+        for (int i = 0; i < count; i++) out[i] = records[(end - count + i) % capacity];
+        return count;
+    }
+
+    Uint64 size() const { return std::min<Uint64>(written.load(std::memory_order_acquire), capacity); }
+
+private:
+    FrameRecord records[capacity];
+    std::atomic<Uint64> written{ 0 };
+};
+
+FrameHistory frameHistory;
+FrameRecord currentFrame;
+Uint64 currentFrameStart = 0;
+Uint64 profilerStart = 0;
+bool showProfiler = false;
+std::string profileCsvPath;
+std::string profileTracePath;
+
+// Bumped once per band by the render threads
+std::atomic<Uint64> ddaStepCounter{ 0 };
+std::atomic<Uint64> texelCounter{ 0 };
+std::atomic<Uint64> spritesCulledCounter{ 0 };
+
+double millisecondsBetween(Uint64 start, Uint64 end)
+{
+    return (end - start) * 1000.0 / (double)SDL_GetPerformanceFrequency();
+}
+
+double millisecondsSince(Uint64 start)
+{
+    return millisecondsBetween(start, SDL_GetPerformanceCounter());
+}
+
+void beginFrame()
+{
+    static Uint64 frameIndex = 0;
+
+    currentFrameStart = SDL_GetPerformanceCounter();
+    if (profilerStart == 0) profilerStart = currentFrameStart;
+
+    currentFrame = FrameRecord();
+    currentFrame.frame = frameIndex++;
+    currentFrame.startMs = millisecondsBetween(profilerStart, currentFrameStart);
+
+    ddaStepCounter = 0;
+    texelCounter = 0;
+    spritesCulledCounter = 0;
+}
+
+void endFrame()
+{
+    currentFrame.frameMs = millisecondsSince(currentFrameStart);
+    currentFrame.ddaSteps = ddaStepCounter;
+    currentFrame.texelsSampled = texelCounter;
+    currentFrame.spritesCulled = spritesCulledCounter;
+    currentFrame.renderScale = renderScale;
+    frameHistory.push(currentFrame);
+}
+
+// Adds the time from start until now to a stage of the current frame
+void recordStage(ProfileStage stage, Uint64 start)
+{
+    if (currentFrame.stageMs[stage] == 0) currentFrame.stageStartMs[stage] = millisecondsBetween(currentFrameStart, start);
+    currentFrame.stageMs[stage] += millisecondsSince(start);
+}
+
+class ScopedTimer
+{
+public:
+    explicit ScopedTimer(ProfileStage stage) : stage(stage), start(SDL_GetPerformanceCounter()) {}
+    ~ScopedTimer() { recordStage(stage, start); }
+
+private:
+    ProfileStage stage;
+    Uint64 start;
+};
+
+void writeProfileCsv(const std::string& path)
+{
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        std::cerr << "Could not open " << path << " for writing.\n";
+        return;
+    }
+
+    std::vector<FrameRecord> records(FrameHistory::capacity);
+    int count = frameHistory.snapshot(records.data(), FrameHistory::capacity);
+
+    file << "frame,start_ms,frame_ms";
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        std::string name = stageNames[s];
+        std::replace(name.begin(), name.end(), ' ', '_');
+        file << "," << name << "_ms";
+    }
+    file << ",dda_steps,texels_sampled,sprites_culled,render_scale\n";
+
+    for (int i = 0; i < count; i++) {
+        const FrameRecord& record = records[i];
+        file << record.frame << "," << record.startMs << "," << record.frameMs;
+        for (int s = 0; s < STAGE_COUNT; s++) file << "," << record.stageMs[s];
+        file << "," << record.ddaSteps << "," << record.texelsSampled << "," << record.spritesCulled << "," << record.renderScale << "\n";
+    }
+
+    std::cout << "Wrote " << count << " frames to " << path << "\n";
+}
+
+// Chrome trace event format, open in chrome://tracing or Perfetto
+void writeProfileTrace(const std::string& path)
+{
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        std::cerr << "Could not open " << path << " for writing.\n";
+        return;
+    }
+
+    std::vector<FrameRecord> records(FrameHistory::capacity);
+    int count = frameHistory.snapshot(records.data(), FrameHistory::capacity);
+
+    file << "{\"traceEvents\":[\n";
+    bool first = true;
+    for (int i = 0; i < count; i++) {
+        const FrameRecord& record = records[i];
+        double frameUs = record.startMs * 1000.0;
+
+        file << (first ? "" : ",\n") << "{\"name\":\"frame " << record.frame << "\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":" << frameUs << ",\"dur\":" << record.frameMs * 1000.0 << "}";
+        first = false;
+
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            if (record.stageMs[s] == 0) continue;
+            file << ",\n{\"name\":\"" << stageNames[s] << "\",\"ph\":\"X\",\"pid\":0,\"tid\":1,\"ts\":" << frameUs + record.stageStartMs[s] * 1000.0 << ",\"dur\":" << record.stageMs[s] * 1000.0 << "}";
+        }
+
+        file << ",\n{\"name\":\"counters\",\"ph\":\"C\",\"pid\":0,\"ts\":" << frameUs << ",\"args\":{\"dda_steps\":" << record.ddaSteps << ",\"texels_sampled\":" << record.texelsSampled << ",\"sprites_culled\":" << record.spritesCulled << "}}";
+    }
+    file << "\n]}\n";
+
+    std::cout << "Wrote " << count << " frames to " << path << "\n";
+}
+
+void writeProfile()
+{
+    if (!profileCsvPath.empty()) writeProfileCsv(profileCsvPath);
+    if (!profileTracePath.empty()) writeProfileTrace(profileTracePath);
+}
+
+// Render scale limits. Above 1 the view is supersampled and filtered down to the viewport.
+const double minRenderScale = 0.25;
+double maxRenderScale = 1.0;
+
+// Resizes the internal render target relative to the viewport
+void setRenderScale(double scale)
+{
+    renderScale = std::max(minRenderScale, std::min(maxRenderScale, scale));
+    renderWidth = std::max(16, (int)(screenWidth * renderScale + 0.5));
+    renderHeight = std::max(16, (int)(viewHeight * renderScale + 0.5));
+}
+
+// Resizes the 3D viewport, the HUD stays below it at its fixed height
+void setResolution(int width, int height)
+{
+    screenWidth = width;
+    viewHeight = height;
+    screenHeight = height + hudHeight;
+    setRenderScale(renderScale);
+}
+
+// Moves the render scale to hold a frame time budget. The frame time is smoothed, nothing changes
+// while it stays inside a band around the target, and after a change the controller waits a few
+// frames so the new cost shows up in the average before it decides again.
+class ResolutionController
+{
+public:
+    void setTarget(double milliseconds) { targetMs = milliseconds; }
+    double target() const { return targetMs; }
+    bool enabled() const { return targetMs > 0; }
+
+    // Takes the time of the frame just finished and returns the scale for the next one
+    double update(double frameMs, double scale)
+    {
+        averageMs = averageMs == 0 ? frameMs : averageMs + (frameMs - averageMs) * smoothing;
+        if (cooldown > 0)
+        {
+            cooldown--;
+            return scale;
+        }
+        if (averageMs <= targetMs * upperBand && averageMs >= targetMs * lowerBand) return scale;
+
+        // Cost follows the pixel count, so the side length moves with the square root of the ratio.
+        // Steps down are allowed to be bigger than steps up, a dropped frame is worse than a soft one.
+        double next = scale * std::sqrt(targetMs / averageMs);
+        next = std::max(scale * 0.75, std::min(scale * 1.1, next));
+        next = std::max(minRenderScale, std::min(maxRenderScale, next));
+        if (std::fabs(next - scale) < 0.01) return scale;
+
+        cooldown = cooldownFrames;
+        averageMs = 0;
+        return next;
+    }
+
+private:
+    static const int cooldownFrames = 8;
+    const double smoothing = 0.1;
+    const double upperBand = 1.05;
+    const double lowerBand = 0.8;
+
+    double targetMs = 0;
+    double averageMs = 0;
+    int cooldown = 0;
+};
+const int ResolutionController::cooldownFrames;
+
+ResolutionController resolutionController;
+
+// Read-only view of a whole file. Writes go to private copy-on-write pages and never reach the disk.
+class MappedFile
+{
+public:
+    MappedFile() {}
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& path)
+    {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE) return false;
+
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+        {
+            close();
+            return false;
+        }
+        mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+        if (mapping == NULL)
+        {
+            close();
+            return false;
+        }
+        view = (Uint8*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+        length = (size_t)fileSize.QuadPart;
+#else
+        int descriptor = ::open(path.c_str(), O_RDONLY);
+        if (descriptor < 0) return false;
+
+        struct stat info;
+        if (fstat(descriptor, &info) != 0 || info.st_size == 0)
+        {
+            ::close(descriptor);
+            return false;
+        }
+        void* address = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, descriptor, 0);
+        ::close(descriptor); // The mapping keeps its own reference
+        if (address == MAP_FAILED) return false;
+        madvise(address, (size_t)info.st_size, MADV_WILLNEED); // Read ahead the whole file in one go
+
+        view = (Uint8*)address;
+        length = (size_t)info.st_size;
+#endif
+        if (view == NULL)
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        if (view) UnmapViewOfFile(view);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (view) munmap(view, length);
+#endif
+        view = NULL;
+        length = 0;
+    }
+
+    void swap(MappedFile& other)
+    {
+        std::swap(view, other.view);
+        std::swap(length, other.length);
+#ifdef _WIN32
+        std::swap(file, other.file);
+        std::swap(mapping, other.mapping);
+#endif
+    }
+
+    Uint8* data() const { return view; }
+    size_t size() const { return length; }
+
+private:
+    Uint8* view = NULL;
+    size_t length = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#endif
+};
+
+// Single-file asset bundle (.pak), written by --pack. A header, an index of named entries and
+// then the file contents back to back, so a cold start reads one file front to back.
+struct BundleHeader
+{
+    char magic[4]; // "RPAK"
+    Uint32 version;
+    Uint32 entryCount;
+    Uint32 reserved;
+};
+
+struct BundleEntry
+{
+    char name[56]; // Path relative to the game directory, e.g. "walls/tile_1.bmp"
+    Uint32 offset, size;
+};
+
+const Uint32 bundleVersion = 1;
+
+class AssetBundle
+{
+public:
+    bool open(const std::string& path)
+    {
+        index.clear();
+        if (!file.open(path)) return false;
+
+        const Uint8* base = file.data();
+        size_t size = file.size();
+        BundleHeader header;
+        if (size >= sizeof(header)) memcpy(&header, base, sizeof(header));
+        if (size < sizeof(header) || memcmp(header.magic, "RPAK", 4) != 0 || header.version != bundleVersion
+            || sizeof(header) + (Uint64)header.entryCount * sizeof(BundleEntry) > size) {
+            std::cerr << "Invalid asset bundle " << path << "\n";
+            file.close();
+            return false;
+        }
+
+        for (Uint32 i = 0; i < header.entryCount; i++) {
+            BundleEntry entry;
+            memcpy(&entry, base + sizeof(header) + i * sizeof(BundleEntry), sizeof(entry));
+            entry.name[sizeof(entry.name) - 1] = '\0';
+            if ((Uint64)entry.offset + entry.size > size) {
+                std::cerr << "Invalid asset bundle " << path << "\n";
+                index.clear();
+                file.close();
+                return false;
+            }
+            index[entry.name] = entry;
+        }
+        return true;
+    }
+
+    bool isOpen() const { return file.data() != NULL; }
+    int assetCount() const { return (int)index.size(); }
+
+    // Opens an asset for the SDL loaders, from the bundle or else from its loose file.
+    // The loaders are passed freesrc so they close it.
+    SDL_RWops* openAsset(const std::string& name) const
+    {
+        std::map<std::string, BundleEntry>::const_iterator found = index.find(name);
+        if (found != index.end()) return SDL_RWFromConstMem(file.data() + found->second.offset, (int)found->second.size);
+        return SDL_RWFromFile(name.c_str(), "rb");
+    }
+
+private:
+    MappedFile file;
+    std::map<std::string, BundleEntry> index; // Read-only once open, so the loader thread can share it
+};
+
+AssetBundle assetBundle;
+
+// Loads a BMP and converts it to the screen format so it can be blitted without conversion
+SDL_Surface* loadSurface(const std::string& fileName)
+{
+    SDL_RWops* source = assetBundle.openAsset(fileName);
+    if (!source) return NULL;
+
+    SDL_Surface* loaded = SDL_LoadBMP_RW(source, 1);
+    if (!loaded) return NULL;
+
+    SDL_Surface* converted = SDL_ConvertSurface(loaded, screenSurface->format, 0);
+    SDL_FreeSurface(loaded);
+    return converted;
+}
+
+bool loadTexture(const std::string& fileName, Texture& texture)
+{
+    SDL_Surface* surface = loadSurface(fileName);
+    if (!surface) return false;
+
+    texture.w = surface->w;
+    texture.h = surface->h;
+    texture.pixels.resize(texture.w * texture.h);
+
+    if (SDL_MUSTLOCK(surface)) SDL_LockSurface(surface);
+    for (int y = 0; y < texture.h; y++)
+    {
+        Uint32* row = (Uint32*)((Uint8*)surface->pixels + y * surface->pitch);
+        std::copy(row, row + texture.w, texture.pixels.begin() + y * texture.w);
+    }
+    if (SDL_MUSTLOCK(surface)) SDL_UnlockSurface(surface);
+
+    SDL_FreeSurface(surface);
+    return true;
+}
+
+// Channel-wise distance fade and side darkening on a pixel already in the screen format
+Uint32 shadePixel(Uint32 pixel, int distfade, int side)
+{
+    const SDL_PixelFormat* format = screenSurface->format;
+
+    int r = (pixel >> format->Rshift) & 0xFF;
+    int g = (pixel >> format->Gshift) & 0xFF;
+    int b = (pixel >> format->Bshift) & 0xFF;
+
+    r = (r - distfade < 0) ? 0 : r - distfade;
+    g = (g - distfade < 0) ? 0 : g - distfade;
+    b = (b - distfade < 0) ? 0 : b - distfade;
+
+    if (side == 1)
+    {
+        r = r >> 1;
+        g = g >> 1;
+        b = b >> 1;
+    }
+
+    return ((Uint32)r << format->Rshift) | ((Uint32)g << format->Gshift) | ((Uint32)b << format->Bshift) | format->Amask;
+}
+
+inline int lightLevel(double perpWallDist)
+{
+    int level = (int)(perpWallDist * lightLevels / fogDistance);
+    return (level < lightLevels) ? level : lightLevels - 1;
+}
+
+// Squared distance between two packed colors, channel by channel
+inline int colorDistance(Uint32 a, Uint32 b)
+{
+    int distance = 0;
+    for (int shift = 0; shift < 32; shift += 8)
+    {
+        int difference = (int)((a >> shift) & 0xFF) - (int)((b >> shift) & 0xFF);
+        distance += difference * difference;
+    }
+    return distance;
+}
+
+// Halves the full size level down to 1x1. Each texel averages a 2x2 block channel by channel
+// and is snapped to the nearest palette color, so every level shades through the same colormap
+void buildMips(Texture& texture)
+{
+    std::map<Uint32, Uint16> nearest;
+    int width = texture.w;
+    int height = texture.h;
+    while (width > 1 || height > 1)
+    {
+        const Uint16* source = texture.mips.data() + texture.mipOffsets.back();
+        int mipWidth = std::max(1, width / 2);
+        int mipHeight = std::max(1, height / 2);
+        std::vector<Uint16> mip(mipWidth * mipHeight);
+        for (int x = 0; x < mipWidth; x++)
+        {
+            for (int y = 0; y < mipHeight; y++)
+            {
+                int x0 = std::min(x * 2, width - 1), x1 = std::min(x * 2 + 1, width - 1);
+                int y0 = std::min(y * 2, height - 1), y1 = std::min(y * 2 + 1, height - 1);
+                Uint32 block[4] = { texture.palette[source[x0 * height + y0]], texture.palette[source[x0 * height + y1]],
+                                    texture.palette[source[x1 * height + y0]], texture.palette[source[x1 * height + y1]] };
+                Uint32 average = 0;
+                for (int shift = 0; shift < 32; shift += 8)
+                {
+                    Uint32 sum = 2;
+                    for (int i = 0; i < 4; i++) sum += (block[i] >> shift) & 0xFF;
+                    average |= (sum / 4) << shift;
+                }
+
+                auto cached = nearest.find(average);
+                if (cached == nearest.end())
+                {
+                    Uint16 best = 0;
+                    for (size_t i = 1; i < texture.palette.size(); i++)
+                    {
+                        if (colorDistance(texture.palette[i], average) < colorDistance(texture.palette[best], average)) best = (Uint16)i;
+                    }
+                    cached = nearest.insert(std::make_pair(average, best)).first;
+                }
+                mip[x * mipHeight + y] = cached->second;
+            }
+        }
+
+        texture.mipOffsets.push_back((int)texture.mips.size());
+        texture.mips.insert(texture.mips.end(), mip.begin(), mip.end());
+        width = mipWidth;
+        height = mipHeight;
+    }
+}
+
+// Splits a texture into palette indices and builds its shaded palettes, so the column
+// loop only does a table lookup per pixel
+void buildColormap(Texture& texture)
+{
+    texture.palette = texture.pixels;
+    std::sort(texture.palette.begin(), texture.palette.end());
+    texture.palette.erase(std::unique(texture.palette.begin(), texture.palette.end()), texture.palette.end());
+
+    // Stored column-major, since walls are drawn one vertical strip at a time
+    texture.mips.resize(texture.pixels.size());
+    texture.mipOffsets.assign(1, 0);
+    for (int y = 0; y < texture.h; y++)
+    {
+        for (int x = 0; x < texture.w; x++)
+        {
+            Uint32 color = texture.pixels[y * texture.w + x];
+            texture.mips[x * texture.h + y] = (Uint16)(std::lower_bound(texture.palette.begin(), texture.palette.end(), color) - texture.palette.begin());
+        }
+    }
+    buildMips(texture);
+
+    size_t colors = texture.palette.size();
+    texture.colormap.resize(lightLevels * 2 * colors);
+    for (int level = 0; level < lightLevels; level++)
+    {
+        int distfade = 10 + level * 250 / (lightLevels - 1); // Higher value = view range shorter / 'darker room'
+        for (int side = 0; side < 2; side++)
+        {
+            Uint32* shades = &texture.colormap[(level * 2 + side) * colors];
+            for (size_t i = 0; i < colors; i++) shades[i] = shadePixel(texture.palette[i], distfade, side);
+        }
+    }
+}
+
+// Stores a sprite texture column by column together with the opaque runs of each column,
+// so drawing can skip transparent texels and whole empty columns. Texels are palette indices
+// like the walls', every light level gets a faded copy of the small palette.
+void buildSpans(Texture& texture)
+{
+    Uint32 colorMask = screenSurface->format->Rmask | screenSurface->format->Gmask | screenSurface->format->Bmask;
+
+    texture.palette = texture.pixels;
+    std::sort(texture.palette.begin(), texture.palette.end());
+    texture.palette.erase(std::unique(texture.palette.begin(), texture.palette.end()), texture.palette.end());
+
+    texture.columns.resize(texture.pixels.size());
+    texture.spanOffsets.assign(texture.w + 1, 0);
+    texture.spans.clear();
+
+    for (int x = 0; x < texture.w; x++)
+    {
+        texture.spanOffsets[x] = (int)texture.spans.size();
+
+        int runStart = -1;
+        for (int y = 0; y <= texture.h; y++)
+        {
+            bool opaque = y < texture.h && (texture.pixels[y * texture.w + x] & colorMask) != 0; // Black is transparent
+            if (y < texture.h)
+            {
+                Uint32 color = texture.pixels[y * texture.w + x];
+                texture.columns[x * texture.h + y] = (Uint16)(std::lower_bound(texture.palette.begin(), texture.palette.end(), color) - texture.palette.begin());
+            }
+
+            if (opaque && runStart < 0) runStart = y;
+            if (!opaque && runStart >= 0)
+            {
+                texture.spans.push_back({ (Uint16)runStart, (Uint16)y });
+                runStart = -1;
+            }
+        }
+    }
+    texture.spanOffsets[texture.w] = (int)texture.spans.size();
+
+    // Same steps as the wall colormaps, less the fade they always have
+    size_t colors = texture.palette.size();
+    texture.spriteShades.resize(lightLevels * colors);
+    std::copy(texture.palette.begin(), texture.palette.end(), texture.spriteShades.begin());
+    for (int level = 1; level < lightLevels; level++)
+    {
+        int fade = level * 250 / (lightLevels - 1);
+        for (size_t i = 0; i < colors; i++) texture.spriteShades[level * colors + i] = shadePixel(texture.palette[i], fade, 0);
+    }
+}
+
+std::string wallTextureFile(int type) { return "walls/tile_" + std::to_string(type) + ".bmp"; }
+std::string spriteTextureFile(int type) { return "sprites/sprite_" + std::to_string(type) + ".bmp"; }
+
+enum TextureUse
+{
+    TEXTURE_WALL,   // Shaded through colormaps
+    TEXTURE_SPRITE  // Drawn from opaque spans
+};
+
+// Reference-counted texture cache. A texture stays loaded while anything holds it and is freed
+// with its last reference. preload() decodes on a background thread so a level can stream in
+// while the current one is playing, texture() picks up the result or loads on the spot.
+class AssetCache
+{
+public:
+    ~AssetCache() { stop(); }
+
+    void start()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = false;
+        if (!loader.joinable()) loader = std::thread(&AssetCache::loaderLoop, this);
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        queueChanged.notify_all();
+        if (loader.joinable()) loader.join();
+    }
+
+    // Queues a texture for the loader thread. It is kept until the next texture() call for it.
+    void preload(const std::string& name, TextureUse use)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Key key(name, use);
+        Slot& slot = slots[key];
+        if (slot.state != SLOT_IDLE || !slot.cached.expired()) return;
+
+        slot.state = SLOT_QUEUED;
+        queue.push_back(key);
+        queueChanged.notify_one();
+    }
+
+    // Never returns null, a texture that failed to load is empty
+    std::shared_ptr<Texture> texture(const std::string& name, TextureUse use)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        Slot& slot = slots[Key(name, use)];
+        for (;;)
+        {
+            std::shared_ptr<Texture> cached = slot.cached.lock();
+            if (cached)
+            {
+                slot.preloaded.reset(); // From here on only the callers keep it alive
+                return cached;
+            }
+            if (slot.state != SLOT_LOADING) break;
+            slotLoaded.wait(lock);
+        }
+
+        // Not loaded, or still queued behind other preloads, so load it here rather than wait
+        slot.state = SLOT_LOADING;
+        lock.unlock();
+        std::shared_ptr<Texture> loaded = decode(name, use);
+        lock.lock();
+
+        slot.cached = loaded;
+        slot.state = SLOT_IDLE;
+        slotLoaded.notify_all();
+        return loaded;
+    }
+
+private:
+    typedef std::pair<std::string, int> Key;
+
+    enum SlotState { SLOT_IDLE, SLOT_QUEUED, SLOT_LOADING };
+
+    struct Slot
+    {
+        std::weak_ptr<Texture> cached;
+        std::shared_ptr<Texture> preloaded; // Holds a preloaded texture until someone takes it
+        SlotState state = SLOT_IDLE;
+    };
+
+    static std::shared_ptr<Texture> decode(const std::string& name, TextureUse use)
+    {
+        std::shared_ptr<Texture> texture = std::make_shared<Texture>();
+        if (!loadTexture(name, *texture)) {
+            std::cerr << "Failed to load " << (use == TEXTURE_WALL ? "wall" : "sprite") << " texture! SDL_Error: " << SDL_GetError() << std::endl;
+            return texture;
+        }
+
+        if (use == TEXTURE_WALL) buildColormap(*texture);
+        else buildSpans(*texture);
+        return texture;
+    }
+
+    void loaderLoop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            queueChanged.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (stopping) return;
+
+            Key key = queue.front();
+            queue.pop_front();
+            Slot& slot = slots[key];
+            if (slot.state != SLOT_QUEUED) continue; // texture() got to it first
+
+            slot.state = SLOT_LOADING;
+            lock.unlock();
+            std::shared_ptr<Texture> loaded = decode(key.first, (TextureUse)key.second);
+            lock.lock();
+
+            slot.cached = loaded;
+            slot.preloaded = loaded;
+            slot.state = SLOT_IDLE;
+            slotLoaded.notify_all();
+        }
+    }
+
+    std::map<Key, Slot> slots;
+    std::deque<Key> queue;
+    std::mutex mutex;
+    std::condition_variable queueChanged;
+    std::condition_variable slotLoaded;
+    std::thread loader;
+    bool stopping = false;
+};
+
+AssetCache assets;
+
+// Everything the game loads, in the order --pack writes it
+std::vector<std::string> bundledAssets()
+{
+    std::vector<std::string> names;
+    names.push_back("ui/uibg.bmp");
+    for (int i = 0; i < numGuns * 2; i++) names.push_back("ui/gun_" + std::to_string(i) + ".bmp");
+    for (int i = 0; i < numFaces; i++) names.push_back("ui/face_" + std::to_string(i) + ".bmp");
+    for (int i = 1; i < wallTypes; i++) names.push_back(wallTextureFile(i));
+    for (int i = 1; i <= spriteTypes; i++) names.push_back(spriteTextureFile(i));
+    names.push_back("font/VCR_OSD_MONO_1.001.ttf");
+    names.push_back("audio/pew.wav");
+    names.push_back("audio/music/e1m1.wav");
+    return names;
+}
+
+// Packs the loose asset files into one bundle, files that are missing are left out
+int packAssets(const std::string& output)
+{
+    std::vector<std::string> names = bundledAssets();
+    std::vector<BundleEntry> entries;
+    std::vector<char> contents;
+
+    for (size_t i = 0; i < names.size(); i++) {
+        if (names[i].size() >= sizeof(BundleEntry::name)) {
+            std::cerr << "Asset name too long for the bundle: " << names[i] << "\n";
+            return 1;
+        }
+
+        std::ifstream file(names[i], std::ios::binary);
+        if (!file.is_open()) {
+            std::cerr << "Skipping missing asset " << names[i] << "\n";
+            continue;
+        }
+        std::vector<char> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+        // Keep every asset 16 byte aligned
+        contents.resize((contents.size() + 15) & ~(size_t)15);
+
+        BundleEntry entry = {};
+        memcpy(entry.name, names[i].c_str(), names[i].size());
+        entry.offset = (Uint32)contents.size();
+        entry.size = (Uint32)bytes.size();
+        entries.push_back(entry);
+        contents.insert(contents.end(), bytes.begin(), bytes.end());
+    }
+
+    BundleHeader header = {};
+    memcpy(header.magic, "RPAK", 4);
+    header.version = bundleVersion;
+    header.entryCount = (Uint32)entries.size();
+
+    Uint32 dataOffset = (Uint32)((sizeof(header) + entries.size() * sizeof(BundleEntry) + 15) & ~(size_t)15);
+    for (size_t i = 0; i < entries.size(); i++) entries[i].offset += dataOffset;
+
+    std::ofstream file(output, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Could not open " << output << " for writing.\n";
+        return 1;
+    }
+    file.write((const char*)&header, sizeof(header));
+    if (!entries.empty()) file.write((const char*)entries.data(), entries.size() * sizeof(BundleEntry));
+    std::vector<char> padding(dataOffset - sizeof(header) - entries.size() * sizeof(BundleEntry), 0);
+    if (!padding.empty()) file.write(padding.data(), padding.size());
+    if (!contents.empty()) file.write(contents.data(), contents.size());
+    if (!file.good()) {
+        std::cerr << "Failed writing " << output << "\n";
+        return 1;
+    }
+
+    printf("Packed %d assets into %s, %d bytes\n", (int)entries.size(), output.c_str(), (int)(dataOffset + contents.size()));
+    return 0;
+}
+
+// Starts decoding the level textures in the background
+void preloadMapTextures()
+{
+    for (int i = 1; i < wallTypes; i++) assets.preload(wallTextureFile(i), TEXTURE_WALL);
+    for (int i = 1; i <= spriteTypes; i++) assets.preload(spriteTextureFile(i), TEXTURE_SPRITE);
+}
+
+// Sprite placed by a map, positions are in world units
+struct MapSprite
+{
+    float x, y;
+    Uint32 type; // sprites/sprite_<type>.bmp
+};
+
+// Binary map file (.bmap), written by --convert from a .rmap text map. Every section is
+// stored ready to use, so loading maps the file and points the world at it without parsing.
+// Fields are little-endian. Sections start on 64 byte boundaries.
+struct MapFileHeader
+{
+    char magic[4]; // "RMAP"
+    Uint32 version;
+    Uint32 width, height; // In cells, see TileMap
+    Uint32 tileShift;
+    Uint32 cellsOffset, cellsSize; // Tile layer in TileMap layout, including its padding
+    Uint32 spritesOffset, spriteCount; // MapSprite table
+    Uint32 accelOffset, accelSize; // Optional TileMap empty radius, same layout as the cells, 0 when absent
+    Uint32 floorOffset, ceilingOffset; // Optional floor and ceiling texture layers, same layout and size as the cells, 0 when absent. Version 2 on.
+    Uint32 lightsOffset, lightCount; // MapLight table. Version 3 on.
+    Uint32 ambientLight; // See MapLighting. Version 3 on.
+};
+
+const Uint32 mapFileVersion = 3;
+const Uint32 mapFileAlignment = 64;
+
+// Light placed by a map, positions are in world units
+struct MapLight
+{
+    float x, y;
+    float radius; // In cells, the light fades out linearly to nothing at this distance
+    float brightness; // 1 is full light right at the source
+};
+
+const float maxLightBrightness = 16.0f;
+
+// Whether a light read from a map file can be baked: finite, inside the map and reaching at most
+// across it
+bool validLight(const MapLight& light, Uint32 width, Uint32 height)
+{
+    float reach = (float)std::max(width, height);
+    return std::isfinite(light.x) && std::isfinite(light.y) && std::isfinite(light.radius) && std::isfinite(light.brightness)
+        && light.x >= 0 && light.x <= width && light.y >= 0 && light.y <= height
+        && light.radius >= 0 && light.radius <= reach
+        && light.brightness >= 0 && light.brightness <= maxLightBrightness;
+}
+
+// Whether a sprite read from a map file stands inside the map
+bool validSprite(const MapSprite& sprite, Uint32 width, Uint32 height)
+{
+    return std::isfinite(sprite.x) && std::isfinite(sprite.y) && sprite.x >= 0 && sprite.x < width && sprite.y >= 0 && sprite.y < height;
+}
+
+// What a map's lightmap is baked from
+struct MapLighting
+{
+    Uint8 ambient = 255; // Light everywhere before any source adds to it, 255 is full light
+    std::vector<MapLight> lights;
+};
+
+// Baked light for every open cell and wall face, stored as extra light levels the shaders add to
+// the distance fade, 0 for full light up to lightLevels - 1 for black. Sources light the points they
+// have a line of sight to, found with checkSight(), so walls and closed doors cast shadows. Open
+// cells are sampled at their centre, which lights their floor, ceiling and the sprites standing
+// in them. Wall faces are sampled just in front of their middle.
+class LightMap
+{
+public:
+    enum Face
+    {
+        FACE_MINUS_X, // Seen by rays going towards +x
+        FACE_PLUS_X,
+        FACE_MINUS_Y,
+        FACE_PLUS_Y
+    };
+
+    void build(const TileMap& map, const VisibilitySets& visibility, const MapLighting& mapLighting)
+    {
+        lighting = mapLighting;
+        mapWidth = map.width();
+        mapHeight = map.height();
+        cellShades.assign((size_t)mapWidth * mapHeight, 0);
+        faceShades.assign((size_t)mapWidth * mapHeight * 4, 0);
+
+        // Full ambient light leaves nothing to add to the plain fog shading
+        shaded = lighting.ambient != 255 || !lighting.lights.empty();
+        if (shaded) relight(map, visibility, 0, 0, mapWidth - 1, mapHeight - 1);
+    }
+
+    // Relights what could have changed after map.set(x, y, ...), once the visibility sets are up to
+    // date. That is the cells around (x, y), whose faces open or close, and everything lit by a
+    // source whose light reaches the cell and can now pass it or be stopped by it.
+    void update(const TileMap& map, const VisibilitySets& visibility, int x, int y)
+    {
+        if (!shaded || !map.contains(x, y)) return;
+
+        int minX = x - 1, minY = y - 1, maxX = x + 1, maxY = y + 1;
+        for (const MapLight& light : lighting.lights)
+        {
+            double nearX = std::max(std::fabs(light.x - (x + 0.5)) - 0.5, 0.0);
+            double nearY = std::max(std::fabs(light.y - (y + 0.5)) - 0.5, 0.0);
+            if (nearX * nearX + nearY * nearY >= light.radius * light.radius) continue;
+
+            minX = std::min(minX, (int)std::floor(light.x - light.radius) - 1);
+            minY = std::min(minY, (int)std::floor(light.y - light.radius) - 1);
+            maxX = std::max(maxX, (int)std::floor(light.x + light.radius) + 1);
+            maxY = std::max(maxY, (int)std::floor(light.y + light.radius) + 1);
+        }
+        relight(map, visibility, std::max(minX, 0), std::max(minY, 0), std::min(maxX, mapWidth - 1), std::min(maxY, mapHeight - 1));
+    }
+
+    // False when the whole map is in full light and every shade is 0
+    bool isShaded() const { return shaded; }
+
+    // Unchecked, the caller makes sure the cell is inside the map
+    int cellShade(int x, int y) const { return cellShades[(size_t)x * mapHeight + y]; }
+
+    // 0 for cells outside the map, which rays can hit at the edge
+    int faceShade(int x, int y, int face) const
+    {
+        if ((unsigned)x >= (unsigned)mapWidth || (unsigned)y >= (unsigned)mapHeight) return 0;
+        return faceShades[((size_t)x * mapHeight + y) * 4 + face];
+    }
+
+private:
+    // Where one shade is sampled and the light summed up there so far
+    struct Sample
+    {
+        double x, y;
+        Uint8* shade;
+        double light;
+    };
+
+    // Bakes every cell and face in [minX, maxX] x [minY, maxY] from scratch
+    void relight(const TileMap& map, const VisibilitySets& visibility, int minX, int minY, int maxX, int maxY)
+    {
+        // Faces are sampled a hair inside the open cell in front of them
+        const double inFront = 1.0 / 1024;
+        static const int faceX[4] = { -1, 1, 0, 0 };
+        static const int faceY[4] = { 0, 0, -1, 1 };
+
+        samples.clear();
+        for (int x = minX; x <= maxX; x++)
+        {
+            for (int y = minY; y <= maxY; y++)
+            {
+                size_t cell = (size_t)x * mapHeight + y;
+                std::fill(&faceShades[cell * 4], &faceShades[cell * 4] + 4, 0);
+                cellShades[cell] = 0;
+                if (map.at(x, y) == 0)
+                {
+                    samples.push_back({ x + 0.5, y + 0.5, &cellShades[cell], 0.0 });
+                    continue;
+                }
+                for (int face = 0; face < 4; face++)
+                {
+                    if (map.cell(x + faceX[face], y + faceY[face]) != 0) continue;
+                    double sampleX = faceX[face] < 0 ? x - inFront : faceX[face] > 0 ? x + 1 + inFront : x + 0.5;
+                    double sampleY = faceY[face] < 0 ? y - inFront : faceY[face] > 0 ? y + 1 + inFront : y + 0.5;
+                    samples.push_back({ sampleX, sampleY, &faceShades[cell * 4 + face], 0.0 });
+                }
+            }
+        }
+
+        // One batch of sight checks per source, over the samples in its reach
+        for (const MapLight& light : lighting.lights)
+        {
+            if (light.radius <= 0 || map.cell((int)std::floor(light.x), (int)std::floor(light.y)) != 0) continue;
+
+            queries.clear();
+            askedFor.clear();
+            for (size_t i = 0; i < samples.size(); i++)
+            {
+                double toX = samples[i].x - light.x;
+                double toY = samples[i].y - light.y;
+                if (toX * toX + toY * toY >= light.radius * light.radius) continue;
+                SightQuery query = { light.x, light.y, samples[i].x, samples[i].y };
+                queries.push_back(query);
+                askedFor.push_back((int)i);
+            }
+
+            seen.resize(queries.size());
+            checkSight(map, visibility, queries.data(), seen.data(), (int)queries.size());
+            for (size_t k = 0; k < askedFor.size(); k++)
+            {
+                if (!seen[k]) continue;
+                Sample& sample = samples[askedFor[k]];
+                double distance = std::sqrt((sample.x - light.x) * (sample.x - light.x) + (sample.y - light.y) * (sample.y - light.y));
+                sample.light += 255.0 * light.brightness * (1 - distance / light.radius);
+            }
+        }
+
+        for (const Sample& sample : samples)
+        {
+            int light = std::min(255, lighting.ambient + (int)sample.light);
+            *sample.shade = (Uint8)((255 - light) * (lightLevels - 1) / 255);
+        }
+    }
+
+    MapLighting lighting;
+    int mapWidth = 0;
+    int mapHeight = 0;
+    bool shaded = false;
+    std::vector<Uint8> cellShades;
+    std::vector<Uint8> faceShades; // Four per cell, indexed by Face
+    std::vector<Sample> samples;
+    std::vector<SightQuery> queries;
+    std::vector<int> askedFor; // Sample of each query
+    std::vector<Uint8> seen;
+};
+
+LightMap lightMap;
+
+// Backs worldMap while a binary map is loaded
+MappedFile mapFile;
+
+// Textures shared with the previous level are kept, the rest go with their last reference
+void loadMapTextures()
+{
+    for (int i = 1; i < wallTypes; i++) wallTextures[i] = assets.texture(wallTextureFile(i), TEXTURE_WALL);
+    for (int i = 1; i <= spriteTypes; i++) spriteTextures[i] = assets.texture(spriteTextureFile(i), TEXTURE_SPRITE);
+}
+
+// Parses the worldMap and spriteMap C arrays of a .rmap text map
+bool parseTextMap(const std::string& filename, TileMap& map, std::vector<MapSprite>& sprites, MapLighting& lighting) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        std::cerr << "Could not open file for reading.\n";
+        return false;
+    }
+
+    std::string line;
+    // Skip to the line containing the map data
+    while (std::getline(file, line)) {
+        if (line.find("int worldMap") != std::string::npos) {
+            break;
+        }
+    }
+
+    // The declaration carries the size, "int worldMap[rows][columns]"
+    int rows = 25;
+    int columns = 25;
+    size_t bracket = line.find('[');
+    if (bracket != std::string::npos) sscanf(line.c_str() + bracket, "[%d][%d]", &rows, &columns);
+    if (rows < 1 || columns < 1) {
+        std::cerr << "Invalid map size in " << filename << "\n";
+        return false;
+    }
+    map.resize(rows, columns);
+
+    for (int y = 0; y < rows; y++) {
+        std::getline(file, line);
+        std::stringstream ss(line);
+        std::string temp;
+
+        // Expecting a line starting with a brace
+        std::getline(ss, temp, '{');
+        for (int x = 0; x < columns; x++) {
+            int mapValue;
+            ss >> mapValue;
+            map.set(y, x, (Uint8)mapValue);
+
+            // Read until the next comma or closing brace
+            std::getline(ss, temp, (x < columns - 1) ? ',' : '}');
+        }
+    }
+    map.rebuildEmptyRadius();
+
+    // Skip to the line containing the sprite data
+    while (std::getline(file, line)) {
+        if (line.find("int spriteMap") != std::string::npos) {
+            break;
+        }
+    }
+
+    sprites.clear();
+    for (int y = 0; y < rows; y++) {
+        std::getline(file, line);
+        std::stringstream ss(line);
+        std::string temp;
+
+        // Expecting a line starting with a brace
+        std::getline(ss, temp, '{');
+        for (int x = 0; x < columns; x++) {          
+            // Read until the next comma or closing brace
+            std::getline(ss, temp, (x < columns - 1) ? ',' : '}');
+            int spriteValue;
+            ss >> spriteValue;
+            if (spriteValue == 0) continue;
+
+            MapSprite placed;
+            placed.y = x + 1.5f;
+            placed.x = y + 0.5f;
+            placed.type = (Uint32)spriteValue;
+            sprites.push_back(placed);
+        }
+    }
+
+    // Optional floor and ceiling textures and lights, laid out like worldMap, and the ambient light
+    lighting = MapLighting();
+    while (std::getline(file, line)) {
+        if (line.find("int ambientLight") != std::string::npos) {
+            int ambient = 255;
+            size_t equals = line.find('=');
+            if (equals != std::string::npos) sscanf(line.c_str() + equals + 1, "%d", &ambient);
+            lighting.ambient = (Uint8)std::max(0, std::min(ambient, 255));
+            continue;
+        }
+
+        bool floorLayer = line.find("int floorMap") != std::string::npos;
+        bool ceilingLayer = line.find("int ceilingMap") != std::string::npos;
+        bool lightLayer = line.find("int lightMap") != std::string::npos;
+        if (!floorLayer && !ceilingLayer && !lightLayer) continue;
+
+        for (int y = 0; y < rows; y++) {
+            std::getline(file, line);
+            std::stringstream ss(line);
+            std::string temp;
+
+            std::getline(ss, temp, '{');
+            for (int x = 0; x < columns; x++) {
+                int textureId = 0;
+                ss >> textureId;
+                if (lightLayer) {
+                    // A light in the middle of the cell, reaching this many cells
+                    if (textureId > 0) lighting.lights.push_back({ y + 0.5f, x + 0.5f, (float)std::min(textureId, std::max(rows, columns)), 1.0f });
+                    std::getline(ss, temp, (x < columns - 1) ? ',' : '}');
+                    continue;
+                }
+                if (textureId < 0 || textureId >= wallTypes) textureId = 0;
+                if (floorLayer) map.setFloorTexture(y, x, (Uint8)textureId);
+                else map.setCeilingTexture(y, x, (Uint8)textureId);
+
+                std::getline(ss, temp, (x < columns - 1) ? ',' : '}');
+            }
+        }
+    }
+
+    return true;
+}
+
+bool writeBinaryMap(const std::string& filename, const TileMap& map, const std::vector<MapSprite>& sprites, const MapLighting& lighting)
+{
+    auto align = [](Uint32 offset) { return (offset + mapFileAlignment - 1) / mapFileAlignment * mapFileAlignment; };
+
+    MapFileHeader header = {};
+    memcpy(header.magic, "RMAP", 4);
+    header.version = mapFileVersion;
+    header.width = map.width();
+    header.height = map.height();
+    header.tileShift = TileMap::tileShift;
+    header.cellsOffset = align(sizeof(MapFileHeader));
+    header.cellsSize = (Uint32)TileMap::storageSize(map.width(), map.height());
+    header.spritesOffset = align(header.cellsOffset + header.cellsSize);
+    header.spriteCount = (Uint32)sprites.size();
+    header.accelOffset = align(header.spritesOffset + header.spriteCount * sizeof(MapSprite));
+    header.accelSize = header.cellsSize;
+    Uint32 end = align(header.accelOffset + header.accelSize);
+    if (map.hasSurfaceTextures()) {
+        header.floorOffset = end;
+        header.ceilingOffset = align(header.floorOffset + header.cellsSize);
+        end = header.ceilingOffset + header.cellsSize;
+    }
+    header.ambientLight = lighting.ambient;
+    header.lightCount = (Uint32)lighting.lights.size();
+    if (header.lightCount) {
+        header.lightsOffset = align(end);
+        end = header.lightsOffset + header.lightCount * sizeof(MapLight);
+    }
+
+    std::vector<Uint8> image(end, 0);
+    memcpy(&image[0], &header, sizeof(header));
+    memcpy(&image[header.cellsOffset], map.data(), header.cellsSize);
+    if (!sprites.empty()) memcpy(&image[header.spritesOffset], sprites.data(), sprites.size() * sizeof(MapSprite));
+    memcpy(&image[header.accelOffset], map.emptyRadiusData(), header.accelSize);
+    if (header.floorOffset) memcpy(&image[header.floorOffset], map.floorData(), header.cellsSize);
+    if (header.ceilingOffset) memcpy(&image[header.ceilingOffset], map.ceilingData(), header.cellsSize);
+    if (header.lightCount) memcpy(&image[header.lightsOffset], lighting.lights.data(), header.lightCount * sizeof(MapLight));
+
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Could not open " << filename << " for writing.\n";
+        return false;
+    }
+    file.write((const char*)image.data(), image.size());
+    return file.good();
+}
+
+// Converts a .rmap text map, the output defaults to the same name with a .bmap extension
+int convertMap(const std::string& input, std::string output)
+{
+    if (output.empty()) output = input.substr(0, input.find_last_of('.')) + ".bmap";
+
+    TileMap map;
+    std::vector<MapSprite> sprites;
+    MapLighting lighting;
+    if (!parseTextMap(input, map, sprites, lighting)) return 1;
+    if (!writeBinaryMap(output, map, sprites, lighting)) return 1;
+
+    printf("Converted %s to %s, %dx%d cells, %d sprites, %d lights\n", input.c_str(), output.c_str(), map.width(), map.height(), (int)sprites.size(), (int)lighting.lights.size());
+    return 0;
+}
+
+void placeSprites(const MapSprite* sprites, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (sprites[i].type < 1 || sprites[i].type > (Uint32)spriteTypes) continue;
+        entities.add(sprites[i].x, sprites[i].y, sprites[i].type);
+    }
+}
+
+// Maps a .bmap file and uses its tile layer in place
+bool loadBinaryMap(const std::string& filename, MapLighting& lighting)
+{
+    MappedFile file;
+    if (!file.open(filename)) {
+        std::cerr << "Could not map " << filename << "\n";
+        return false;
+    }
+
+    const Uint8* base = file.data();
+    size_t size = file.size();
+    MapFileHeader header;
+    if (size < sizeof(header)) {
+        std::cerr << "Invalid map file " << filename << "\n";
+        return false;
+    }
+    memcpy(&header, base, sizeof(header));
+    if (header.version == 1) header.floorOffset = header.ceilingOffset = 0; // Older files stop before these
+    if (header.version < 3) {
+        header.lightsOffset = header.lightCount = 0;
+        header.ambientLight = 255;
+    }
+
+    // Reject anything that would read outside the file or disagree with the tile layout
+    bool valid = memcmp(header.magic, "RMAP", 4) == 0 && header.version >= 1 && header.version <= mapFileVersion
+        && header.width >= 1 && header.height >= 1 && header.width <= 0xFFFF && header.height <= 0xFFFF
+        && header.tileShift == (Uint32)TileMap::tileShift
+        && header.cellsSize == TileMap::storageSize(header.width, header.height)
+        && header.cellsOffset % mapFileAlignment == 0 && header.spritesOffset % mapFileAlignment == 0
+        && (Uint64)header.cellsOffset + header.cellsSize <= size
+        && (Uint64)header.spritesOffset + (Uint64)header.spriteCount * sizeof(MapSprite) <= size
+        && (Uint64)header.accelOffset + header.accelSize <= size
+        && (Uint64)header.floorOffset + header.cellsSize <= size
+        && (Uint64)header.ceilingOffset + header.cellsSize <= size
+        && header.lightsOffset % mapFileAlignment == 0 && header.ambientLight <= 255
+        && (Uint64)header.lightsOffset + (Uint64)header.lightCount * sizeof(MapLight) <= size;
+    const MapSprite* sprites = (const MapSprite*)(base + header.spritesOffset);
+    for (Uint32 i = 0; valid && i < header.spriteCount; i++) valid = validSprite(sprites[i], header.width, header.height);
+    const MapLight* lights = (const MapLight*)(base + header.lightsOffset);
+    for (Uint32 i = 0; valid && i < header.lightCount; i++) valid = validLight(lights[i], header.width, header.height);
+    if (!valid) {
+        std::cerr << "Invalid map file " << filename << "\n";
+        return false;
+    }
+
+    Uint8* emptyRadius = header.accelSize == header.cellsSize ? file.data() + header.accelOffset : NULL;
+    Uint8* floorIds = header.floorOffset ? file.data() + header.floorOffset : NULL;
+    Uint8* ceilingIds = header.ceilingOffset ? file.data() + header.ceilingOffset : NULL;
+    worldMap.adopt(header.width, header.height, file.data() + header.cellsOffset, emptyRadius, floorIds, ceilingIds);
+    if (emptyRadius && !worldMap.emptyRadiusValid()) {
+        // A stale radius would let rays skip through walls. The mapping is copy-on-write, the file keeps it.
+        std::cerr << "Rebuilding the empty radius of " << filename << ", the stored one doesn't fit the map\n";
+        worldMap.rebuildEmptyRadius();
+    }
+    placeSprites(sprites, header.spriteCount);
+
+    lighting.ambient = (Uint8)header.ambientLight;
+    lighting.lights.assign(lights, lights + header.lightCount);
+
+    // Keep the new mapping alive, the old one goes away with the local
+    mapFile.swap(file);
+    return true;
+}
+
+// Last write time of a file in the platform's own units, 0 when there is no such file
+Uint64 fileWriteTime(const std::string& path)
+{
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attributes)) return 0;
+    return ((Uint64)attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) return 0;
+    return (Uint64)info.st_mtime;
+#endif
+}
+
+// Loads a .bmap directly. For a .rmap, a converted .bmap next to it is used when there is one
+// and it was written after the .rmap was last changed. False when neither could be loaded.
+bool loadMap(const std::string& filename) {
+    viewInvalid = true;
+    entities.clear();
+    loadMapTextures();
+
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    std::string binaryName = filename.substr(0, filename.find_last_of('.')) + ".bmap";
+    Uint64 binaryTime = fileWriteTime(binaryName);
+    bool current = binaryName == filename || binaryTime >= fileWriteTime(filename);
+    if (binaryTime != 0 && !current) std::cout << "Ignoring " << binaryName << ", it is older than " << filename << "\n";
+
+    bool loaded = false;
+    MapLighting lighting;
+    if (binaryTime != 0 && current) loaded = loadBinaryMap(binaryName, lighting);
+
+    if (!loaded) {
+        std::vector<MapSprite> sprites;
+        if (!parseTextMap(filename, worldMap, sprites, lighting)) return false;
+        mapFile.close();
+        placeSprites(sprites.data(), (int)sprites.size());
+    }
+
+    worldMap.fillFlatSurfaces((Uint8)defaultFloorTexture, (Uint8)defaultCeilingTexture);
+    visibilitySets.build(worldMap);
+    lightMap.build(worldMap, visibilitySets, lighting);
+
+    double elapsed = (double)(SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+    std::cout << "Loaded Map " << (loaded ? binaryName : filename) << " in " << elapsed << " ms\n";
+    return true;
+}
+
+// Changes one cell of the loaded map, e.g. a door (tile 9) opening or a wall coming down, and
+// brings the visibility sets and the lightmap up to date around it. Only between ticks and
+// frames, the simulation and the renderer read the map without locking.
+void setMapCell(int x, int y, Uint8 value)
+{
+    if (!worldMap.contains(x, y)) return;
+    worldMap.set(x, y, value);
+    visibilitySets.update(worldMap, x, y);
+    lightMap.update(worldMap, visibilitySets, x, y);
+    viewInvalid = true;
+}
+
+void loadMedia()
+{
+    std::string nameOfFile = "ui/uibg.bmp";
+    uibg = loadSurface(nameOfFile);
+
+    Uint32 colorKey = SDL_MapRGB(screenSurface->format, 0x00, 0x00, 0x00); // Black color
+
+    // Gun UI
+    for (int i = 0; i < numGuns*2; i++) {
+        std::string fileName = "ui/gun_" + std::to_string(i) + ".bmp";
+        gunTextures[i] = loadSurface(fileName);
+        if (!gunTextures[i]) {
+            std::cerr << "Failed to load UI texture! SDL_Error: " << SDL_GetError() << std::endl;
+            continue;
+        }
+        SDL_SetColorKey(gunTextures[i], SDL_TRUE, colorKey);
+    }
+    // Face UI
+    for (int i = 0; i < numFaces; i++) {
+        std::string fileName = "ui/face_" + std::to_string(i) + ".bmp";
+        faceTextures[i] = loadSurface(fileName);
+        if (!faceTextures[i]) {
+            std::cerr << "Failed to load UI texture! SDL_Error: " << SDL_GetError() << std::endl;
+            continue;
+        }
+        SDL_SetColorKey(faceTextures[i], SDL_TRUE, colorKey);
+    }
+
+}
+
+// TEXT
+// Every printable ASCII glyph of a font is rasterized once at load and kept as the runs of set
+// pixels on each of its rows. Drawing a string is then a few span fills straight into a surface,
+// with no TTF calls, temporary surfaces or allocations per frame.
+struct GlyphSpan
+{
+    Uint16 y;
+    Uint16 start;
+    Uint16 end;
+};
+
+class GlyphAtlas
+{
+public:
+    static const int firstChar = 32;
+    static const int lastChar = 126;
+
+    bool build(TTF_Font* font)
+    {
+        spans.clear();
+        lineHeight = 0;
+        maxAdvance = 0;
+        if (font == NULL) return false;
+
+        lineHeight = TTF_FontHeight(font);
+        SDL_Color white = { 255, 255, 255, 255 };
+        for (int c = firstChar; c <= lastChar; c++)
+        {
+            Glyph& glyph = glyphs[c - firstChar];
+            glyph.advance = 0;
+            TTF_GlyphMetrics(font, (Uint16)c, NULL, NULL, NULL, NULL, &glyph.advance);
+            maxAdvance = std::max(maxAdvance, glyph.advance);
+            glyph.firstSpan = (int)spans.size();
+
+            // Solid glyphs come back 8-bit with index 0 as the background
+            SDL_Surface* rendered = TTF_RenderGlyph_Solid(font, (Uint16)c, white);
+            if (rendered != NULL)
+            {
+                if (SDL_MUSTLOCK(rendered)) SDL_LockSurface(rendered);
+                for (int y = 0; y < rendered->h; y++)
+                {
+                    const Uint8* row = (const Uint8*)rendered->pixels + y * rendered->pitch;
+                    int runStart = -1;
+                    for (int x = 0; x <= rendered->w; x++)
+                    {
+                        bool set = x < rendered->w && row[x] != 0;
+                        if (set && runStart < 0) runStart = x;
+                        else if (!set && runStart >= 0)
+                        {
+                            GlyphSpan span = { (Uint16)y, (Uint16)runStart, (Uint16)x };
+                            spans.push_back(span);
+                            runStart = -1;
+                        }
+                    }
+                }
+                if (SDL_MUSTLOCK(rendered)) SDL_UnlockSurface(rendered);
+                SDL_FreeSurface(rendered);
+            }
+            glyph.endSpan = (int)spans.size();
+        }
+        return true;
+    }
+
+    bool loaded() const { return lineHeight > 0; }
+    int height() const { return lineHeight; }
+    int widest() const { return maxAdvance; }
+    int advance(int glyph) const { return glyphs[glyph].advance; }
+
+    // Anything outside printable ASCII shows as '?'
+    static int glyphIndex(char c) { return (c >= firstChar && c <= lastChar) ? c - firstChar : '?' - firstChar; }
+
+    // Fills a glyph's spans with color, with the top left of its line at x, y, clipped to width x height
+    void drawGlyph(int glyph, Uint32* pixels, int pitch, int width, int height, int x, int y, Uint32 color) const
+    {
+        const Glyph& g = glyphs[glyph];
+        for (int i = g.firstSpan; i < g.endSpan; i++)
+        {
+            const GlyphSpan& span = spans[i];
+            int row = y + span.y;
+            if (row < 0 || row >= height) continue;
+
+            int start = std::max(0, x + span.start);
+            int end = std::min(width, x + span.end);
+            if (start < end) std::fill(pixels + row * pitch + start, pixels + row * pitch + end, color);
+        }
+    }
+
+private:
+    struct Glyph
+    {
+        int advance = 0;
+        int firstSpan = 0;
+        int endSpan = 0;
+    };
+
+    Glyph glyphs[lastChar - firstChar + 1];
+    std::vector<GlyphSpan> spans;
+    int lineHeight = 0;
+    int maxAdvance = 0;
+};
+
+GlyphAtlas hudText; // From font
+GlyphAtlas overlayText; // From overlayFont
+
+// A line of text laid out against an atlas. Layout only happens again when the text changes and
+// the storage is fixed, so neither setting nor drawing a label allocates.
+class TextLabel
+{
+public:
+    static const int maxLength = 160;
+
+    // Returns whether the text changed
+    bool set(const GlyphAtlas& font, const char* newText)
+    {
+        if (atlas == &font && strncmp(newText, text, maxLength) == 0) return false;
+
+        atlas = &font;
+        length = 0;
+        textWidth = 0;
+        while (length < maxLength && newText[length] != '\0')
+        {
+            text[length] = newText[length];
+            glyphs[length] = (Uint8)GlyphAtlas::glyphIndex(newText[length]);
+            offsets[length] = textWidth;
+            textWidth += font.advance(glyphs[length]);
+            length++;
+        }
+        text[length] = '\0';
+        return true;
+    }
+
+    int width() const { return textWidth; }
+
+    // Draws into a 32-bit surface with the top left of the text at x, y
+    void draw(SDL_Surface* surface, int x, int y, Uint32 color) const
+    {
+        if (atlas == NULL || length == 0) return;
+
+        if (SDL_MUSTLOCK(surface)) SDL_LockSurface(surface);
+        Uint32* pixels = (Uint32*)surface->pixels;
+        int pitch = surface->pitch / sizeof(Uint32);
+        for (int i = 0; i < length; i++)
+        {
+            atlas->drawGlyph(glyphs[i], pixels, pitch, surface->w, surface->h, x + offsets[i], y, color);
+        }
+        if (SDL_MUSTLOCK(surface)) SDL_UnlockSurface(surface);
+    }
+
+private:
+    const GlyphAtlas* atlas = NULL;
+    char text[maxLength + 1] = {};
+    Uint8 glyphs[maxLength];
+    int offsets[maxLength];
+    int length = 0;
+    int textWidth = 0;
+};
+
+// Opens the fonts and builds their atlases, needs TTF_Init
+void loadFonts()
+{
+    font = TTF_OpenFontRW(assetBundle.openAsset("font/VCR_OSD_MONO_1.001.ttf"), 1, 36);
+    if (font == NULL)
+    {
+        printf("Failed to load font! SDL_ttf Error: %s\n", TTF_GetError());
+    }
+
+    overlayFont = TTF_OpenFontRW(assetBundle.openAsset("font/VCR_OSD_MONO_1.001.ttf"), 1, 14);
+
+    hudText.build(font);
+    overlayText.build(overlayFont);
+}
+
+void loadAudioAndFont()
+{
+    // Audio
+    if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048) < 0)
+    {
+        printf("SDL_mixer could not initialize! SDL_mixer Error: %s\n", Mix_GetError());
+    }
+
+    music = Mix_LoadMUS_RW(assetBundle.openAsset("audio/music/e1m1.wav"), 1);
+    if (music == NULL)
+    {
+        printf("Failed to load music! SDL_mixer Error: %s\n", Mix_GetError());
+    }
+
+    fire = Mix_LoadWAV_RW(assetBundle.openAsset("audio/pew.wav"), 1);
+    if (fire == NULL)
+    {
+        printf("Failed to load sound effect! SDL_mixer Error: %s\n", Mix_GetError());
+    }
+
+    loadFonts();
+}
+
+// The part of a HUD slot that is on the HUD layer, empty when none is. Narrow resolutions push
+// the slots past its edges.
+SDL_Rect hudSlot(const SDL_Rect& slot)
+{
+    SDL_Rect hud = { 0, 0, screenWidth, hudHeight };
+    SDL_Rect visible = { 0, 0, 0, 0 };
+    SDL_IntersectRect(&slot, &hud, &visible);
+    return visible;
+}
+
+// Where all the faces go, the part of the HUD layer that changes
+SDL_Rect faceSlot()
+{
+    SDL_Rect slot = { screenWidth / 2 - 72, hudHeight - 160, 0, 0 };
+    for (int i = 0; i < numFaces; i++)
+    {
+        if (faceTextures[i] == NULL) continue;
+        slot.w = std::max(slot.w, faceTextures[i]->w);
+        slot.h = std::max(slot.h, faceTextures[i]->h);
+    }
+    return hudSlot(slot);
+}
+
+// Where the gun goes this frame, cut off at the bottom of the view since the HUD covers the rest
+SDL_Rect gunRect()
+{
+    SDL_Rect rect = { screenWidth / 2 - (192/2) + gunOffsetX, viewHeight - 180 + gunOffsetY, 0, 0 };
+    SDL_Surface* gun = gunTextures[gunTexture];
+    if (gun == NULL) return rect;
+
+    int left = std::max(0, rect.x), top = std::max(0, rect.y);
+    int right = std::min(screenWidth, rect.x + gun->w), bottom = std::min(viewHeight, rect.y + gun->h);
+    SDL_Rect visible = { left, top, std::max(0, right - left), std::max(0, bottom - top) };
+    return visible;
+}
+
+// Where the ammo and health counters go, either side of the face. Each has room for
+// hudCounterLength characters so a counter that changes only redraws its own slot.
+const int hudCounterLength = 11;
+SDL_Rect ammoSlot()
+{
+    SDL_Rect slot = { screenWidth / 2 + 80, 20, hudText.widest() * hudCounterLength, hudText.height() };
+    return hudSlot(slot);
+}
+
+// Right-aligned, the counter ends at the slot's right edge even when the left of it is cut off
+SDL_Rect healthSlot()
+{
+    int width = hudText.widest() * hudCounterLength;
+    SDL_Rect slot = { screenWidth / 2 - 80 - width, 20, width, hudText.height() };
+    return hudSlot(slot);
+}
+
+TextLabel ammoLabel;
+TextLabel healthLabel;
+
+// Puts uibg back over part of the HUD layer
+void clearHud(SDL_Rect rect)
+{
+    SDL_Rect destination = rect;
+    SDL_FillRect(hudLayer, &rect, SDL_MapRGB(hudLayer->format, 0x00, 0x00, 0x00));
+    SDL_BlitSurface(uibg, &rect, hudLayer, &destination);
+}
+
+// Brings the gun offset and the HUD layer up to date, the HUD is only composited again where
+// the face or a counter changed
+void renderUI()
+{   
+    //gunOffsetY = abs(gunOffsetX / 3);
+    gunOffsetY = ((1.0f/200.0f) * (gunOffsetX * gunOffsetX));
+
+    bool whole = hudFace < 0 || fullRedraw;
+    bool changed = whole;
+    if (whole)
+    {
+        //SDL_FillRect(screenSurface, UIBase, SDL_MapRGB(screenSurface->format, 0x14, 0x23, 0x14));
+        SDL_FillRect(hudLayer, NULL, SDL_MapRGB(hudLayer->format, 0x00, 0x00, 0x00));
+        SDL_BlitSurface(uibg, NULL, hudLayer, NULL);
+    }
+
+    if (whole || faceTexture != hudFace)
+    {
+        SDL_Rect faceRect = faceSlot();
+        if (!whole) clearHud(faceRect);
+        SDL_BlitSurface(faceTextures[faceTexture], NULL, hudLayer, &faceRect);
+        hudFace = faceTexture;
+        changed = true;
+    }
+
+    Uint32 textColor = SDL_MapRGB(hudLayer->format, 255, 0, 0);
+    char text[32];
+
+    snprintf(text, sizeof(text), "AMMO: %d", ammo);
+    if (ammoLabel.set(hudText, text) || whole)
+    {
+        SDL_Rect slot = ammoSlot();
+        if (!whole) clearHud(slot);
+        ammoLabel.draw(hudLayer, slot.x, slot.y, textColor);
+        changed = true;
+    }
+
+    snprintf(text, sizeof(text), "HEALTH: %d", health);
+    if (healthLabel.set(hudText, text) || whole)
+    {
+        SDL_Rect slot = healthSlot();
+        if (!whole) clearHud(slot);
+        healthLabel.draw(hudLayer, slot.x + slot.w - healthLabel.width(), slot.y, textColor);
+        changed = true;
+    }
+
+    if (changed) hudVersion++;
+}
+
+// Stacked bar graph of the recent stage timings plus the latest numbers, toggled with F3
+void renderProfilerOverlay()
+{
+    static const Uint8 stageColors[STAGE_COUNT][3] = {
+        { 0xE0, 0x40, 0x40 }, { 0xE0, 0x90, 0x40 }, { 0xE0, 0xE0, 0x40 }, { 0x40, 0xE0, 0x40 }, { 0x40, 0xE0, 0xC0 }, { 0x40, 0x80, 0xE0 }, { 0xC0, 0x40, 0xE0 }, { 0xA0, 0xA0, 0xA0 }, { 0xE0, 0xA0, 0xC0 }
+    };
+    static FrameRecord records[160];
+    static TextLabel textLines[3];
+    static Uint64 lastTextUpdate = 0;
+    static int framesSinceUpdate = 0;
+
+    const int barWidth = 2;
+    const double pixelsPerMs = 4.0;
+    int graphHeight = std::min(viewHeight / 2, 100);
+
+    int count = frameHistory.snapshot(records, std::min(160, screenWidth / barWidth));
+    if (count == 0) return;
+
+    for (int i = 0; i < count; i++)
+    {
+        int top = graphHeight;
+        for (int s = 0; s < STAGE_COUNT; s++)
+        {
+            int height = (int)(records[i].stageMs[s] * pixelsPerMs + 0.5);
+            if (height <= 0) continue;
+            if (top - height < 0) height = top;
+            top -= height;
+
+            SDL_Rect bar = { i * barWidth, top, barWidth, height };
+            SDL_FillRect(frameSurface, &bar, SDL_MapRGB(frameSurface->format, stageColors[s][0], stageColors[s][1], stageColors[s][2]));
+        }
+    }
+
+    // 60 fps budget line
+    SDL_Rect budget = { 0, graphHeight - (int)(16.6 * pixelsPerMs), count * barWidth, 1 };
+    if (budget.y >= 0) SDL_FillRect(frameSurface, &budget, SDL_MapRGB(frameSurface->format, 0xFF, 0xFF, 0xFF));
+
+    if (!overlayText.loaded()) return;
+
+    // The numbers change a few times a second so they stay readable
+    framesSinceUpdate++;
+    Uint64 now = SDL_GetPerformanceCounter();
+    if (now - lastTextUpdate > SDL_GetPerformanceFrequency() / 4)
+    {
+        double fps = lastTextUpdate == 0 ? 0.0 : framesSinceUpdate * (double)SDL_GetPerformanceFrequency() / (now - lastTextUpdate);
+        lastTextUpdate = now;
+        framesSinceUpdate = 0;
+        const FrameRecord& last = records[count - 1];
+
+        char lines[3][TextLabel::maxLength];
+        snprintf(lines[0], sizeof(lines[0]), "%.0f fps", fps);
+        snprintf(lines[1], sizeof(lines[1]), "%.2fms cast %.2f floor %.2f sort %.2f spr %.2f up %.2f ui %.2f pres %.2f in %.2f sim %.2f",
+            last.frameMs, last.stageMs[STAGE_WALL_CAST], last.stageMs[STAGE_FLOOR_CAST], last.stageMs[STAGE_SPRITE_SORT], last.stageMs[STAGE_SPRITE_DRAW],
+            last.stageMs[STAGE_UPSCALE], last.stageMs[STAGE_UI], last.stageMs[STAGE_PRESENT], last.stageMs[STAGE_INPUT], last.stageMs[STAGE_SIMULATE]);
+        snprintf(lines[2], sizeof(lines[2]), "dda %llu texels %llu culled %llu scale %.2f",
+            (unsigned long long)last.ddaSteps, (unsigned long long)last.texelsSampled, (unsigned long long)last.spritesCulled, last.renderScale);
+
+        for (int i = 0; i < 3; i++) textLines[i].set(overlayText, lines[i]);
+    }
+
+    Uint32 textColor = SDL_MapRGB(frameSurface->format, 0xFF, 0xFF, 0xFF);
+    for (int i = 0; i < 3; i++)
+    {
+        textLines[i].draw(frameSurface, 2, graphHeight + 2 + i * overlayText.height(), textColor);
+    }
+}
+
+// Sprites bucketed by the map cells they cover, for hitscans. A sprite is a disc of spriteRadius
+// around its position and is listed in every cell its bounding square touches, at most four, so a
+// ray only has to look at the cells it passes through. Each cell holds a doubly linked list of
+// entries, a sprite that moves into other cells unlinks and relinks its own entries only.
+// Owned by whoever runs the simulation ticks.
+class SpriteGrid
+{
+public:
+    static const int cellsPerSprite = 4;
+
+    void build(const EntityStore& sprites, int width, int height)
+    {
+        gridWidth = width;
+        gridHeight = height;
+        heads.assign((size_t)width * height, -1);
+        entryCell.assign((size_t)sprites.size() * cellsPerSprite, -1);
+        entryNext.assign(entryCell.size(), -1);
+        entryPrevious.assign(entryCell.size(), -1);
+        footprints.assign(sprites.size(), noFootprint);
+
+        for (int i = 0; i < sprites.size(); i++)
+        {
+            if (sprites.texture[i] != 0) insert(i, sprites.x[i], sprites.y[i]);
+        }
+    }
+
+    // Call after changing a sprite's position. Cheap while it stays on the same cells.
+    void move(int index, double x, double y)
+    {
+        if (footprints[index] == noFootprint || footprints[index] == footprint(x, y)) return;
+        remove(index);
+        insert(index, x, y);
+    }
+
+    // First entry of a cell, -1 for none. Entries hold their sprite at entry / cellsPerSprite.
+    int first(int x, int y) const
+    {
+        if (x < 0 || y < 0 || x >= gridWidth || y >= gridHeight) return -1;
+        return heads[(size_t)x * gridHeight + y];
+    }
+
+    int next(int entry) const { return entryNext[entry]; }
+
+private:
+    static const Uint64 noFootprint = ~(Uint64)0;
+
+    // Cells a sprite covers, the lowest cell and whether it spills into the next column and row
+    Uint64 footprint(double x, double y) const
+    {
+        int minX = (int)std::floor(x - spriteRadius);
+        int minY = (int)std::floor(y - spriteRadius);
+        int spillX = (int)std::floor(x + spriteRadius) - minX;
+        int spillY = (int)std::floor(y + spriteRadius) - minY;
+        return ((Uint64)(Uint32)minX << 32) | ((Uint64)((Uint32)minY & 0x3FFFFFFF) << 2) | (spillX << 1) | spillY;
+    }
+
+    void insert(int index, double x, double y)
+    {
+        footprints[index] = footprint(x, y);
+
+        int minX = std::max(0, (int)std::floor(x - spriteRadius));
+        int maxX = std::min(gridWidth - 1, (int)std::floor(x + spriteRadius));
+        int minY = std::max(0, (int)std::floor(y - spriteRadius));
+        int maxY = std::min(gridHeight - 1, (int)std::floor(y + spriteRadius));
+
+        int entry = index * cellsPerSprite;
+        for (int cellX = minX; cellX <= maxX; cellX++)
+        {
+            for (int cellY = minY; cellY <= maxY; cellY++, entry++)
+            {
+                int cell = cellX * gridHeight + cellY;
+                entryCell[entry] = cell;
+                entryPrevious[entry] = -1;
+                entryNext[entry] = heads[cell];
+                if (heads[cell] >= 0) entryPrevious[heads[cell]] = entry;
+                heads[cell] = entry;
+            }
+        }
+    }
+
+    void remove(int index)
+    {
+        for (int entry = index * cellsPerSprite; entry < (index + 1) * cellsPerSprite; entry++)
+        {
+            int cell = entryCell[entry];
+            if (cell < 0) continue;
+
+            if (entryPrevious[entry] >= 0) entryNext[entryPrevious[entry]] = entryNext[entry];
+            else heads[cell] = entryNext[entry];
+            if (entryNext[entry] >= 0) entryPrevious[entryNext[entry]] = entryPrevious[entry];
+            entryCell[entry] = -1;
+        }
+    }
+
+    int gridWidth = 0;
+    int gridHeight = 0;
+    std::vector<int> heads;
+    std::vector<int> entryCell;
+    std::vector<int> entryNext;
+    std::vector<int> entryPrevious;
+    std::vector<Uint64> footprints;
+};
+const int SpriteGrid::cellsPerSprite;
+const Uint64 SpriteGrid::noFootprint;
+
+SpriteGrid spriteGrid;
+
+const double hitscanRange = 100.0;
+
+struct HitscanRay
+{
+    double x, y;
+    double dirX, dirY;
+    double range = hitscanRange;
+};
+
+enum HitKind
+{
+    HIT_NONE,
+    HIT_WALL,
+    HIT_SPRITE
+};
+
+struct HitscanResult
+{
+    HitKind kind = HIT_NONE;
+    double distance = 0; // Along the ray, in cells
+    int cellX = 0, cellY = 0; // Wall cell that was hit
+    int sprite = -1;
+};
+
+// Distance along a unit ray to where it enters a sprite's disc, or -1 for a miss.
+// A ray that starts inside the disc hits it right away.
+double raySpriteDistance(const HitscanRay& ray, double dirX, double dirY, double spriteX, double spriteY)
+{
+    double toX = spriteX - ray.x;
+    double toY = spriteY - ray.y;
+    double along = toX * dirX + toY * dirY;
+    double missSquared = toX * toX + toY * toY - along * along;
+    if (missSquared > spriteRadius * spriteRadius) return -1;
+
+    double halfChord = std::sqrt(spriteRadius * spriteRadius - missSquared);
+    if (along + halfChord < 0) return -1;
+    return std::max(0.0, along - halfChord);
+}
+
+// Walks the ray cell by cell and returns the nearest wall or sprite. Sprites are looked up in the
+// grid of the cells the ray passes, so the cost follows the distance and not the sprite count.
+HitscanResult traceHitscan(const EntityStore& sprites, const HitscanRay& ray)
+{
+    HitscanResult result;
+
+    double length = std::sqrt(ray.dirX * ray.dirX + ray.dirY * ray.dirY);
+    if (length == 0) return result;
+    double dirX = ray.dirX / length;
+    double dirY = ray.dirY / length;
+
+    int mapX = (int)std::floor(ray.x);
+    int mapY = (int)std::floor(ray.y);
+    double deltaDistX = dirX == 0 ? 1e30 : std::fabs(1 / dirX);
+    double deltaDistY = dirY == 0 ? 1e30 : std::fabs(1 / dirY);
+    int stepX = dirX < 0 ? -1 : 1;
+    int stepY = dirY < 0 ? -1 : 1;
+    double sideDistX = (dirX < 0 ? ray.x - mapX : mapX + 1.0 - ray.x) * deltaDistX;
+    double sideDistY = (dirY < 0 ? ray.y - mapY : mapY + 1.0 - ray.y) * deltaDistY;
+
+    double cellEntry = 0;
+    double bestSprite = 1e30;
+    while (cellEntry <= ray.range)
+    {
+        // A sprite in front of the wall was already found in an earlier cell
+        if (worldMap.cell(mapX, mapY) != 0)
+        {
+            if (result.sprite >= 0 && bestSprite <= cellEntry) break;
+            result.kind = HIT_WALL;
+            result.distance = cellEntry;
+            result.cellX = mapX;
+            result.cellY = mapY;
+            result.sprite = -1;
+            return result;
+        }
+
+        for (int entry = spriteGrid.first(mapX, mapY); entry >= 0; entry = spriteGrid.next(entry))
+        {
+            int index = entry / SpriteGrid::cellsPerSprite;
+            double distance = raySpriteDistance(ray, dirX, dirY, sprites.x[index], sprites.y[index]);
+            if (distance >= 0 && distance < bestSprite)
+            {
+                bestSprite = distance;
+                result.sprite = index;
+            }
+        }
+
+        // Nothing in a later cell can be nearer than a disc entered before this cell ends
+        double cellExit = std::min(sideDistX, sideDistY);
+        if (result.sprite >= 0 && bestSprite <= cellExit) break;
+
+        if (sideDistX < sideDistY)
+        {
+            sideDistX += deltaDistX;
+            mapX += stepX;
+        }
+        else
+        {
+            sideDistY += deltaDistY;
+            mapY += stepY;
+        }
+        cellEntry = cellExit;
+    }
+
+    if (result.sprite >= 0 && bestSprite <= ray.range)
+    {
+        result.kind = HIT_SPRITE;
+        result.distance = bestSprite;
+    }
+    else result.sprite = -1;
+    return result;
+}
+
+// Resolves many shooters at once, for example every enemy firing in a tick. The rays share the
+// grid and the map, which stay put for the whole batch.
+void traceHitscans(const EntityStore& sprites, const HitscanRay* rays, HitscanResult* results, int count)
+{
+    for (int i = 0; i < count; i++) results[i] = traceHitscan(sprites, rays[i]);
+}
+
+// Enemies further away than this never notice the player
+const double awarenessRange = 16.0;
+
+// Which live enemies can see the player. All of them are asked in one batch, most pairs out of
+// sight of each other never cast a ray. Nothing acts on seesPlayer yet, it is there for enemy AI.
+void updateAwareness(GameState& state)
+{
+    static thread_local std::vector<SightQuery> queries;
+    static thread_local std::vector<int> askers;
+    static thread_local std::vector<Uint8> answers;
+    queries.clear();
+    askers.clear();
+
+    EntityStore& store = state.entities;
+    for (int i = 0; i < store.size(); i++)
+    {
+        store.seesPlayer[i] = 0;
+        if (store.texture[i] != 1 || store.state[i] == ENTITY_DEAD) continue;
+
+        double toX = state.posX - store.x[i];
+        double toY = state.posY - store.y[i];
+        if (toX * toX + toY * toY > awarenessRange * awarenessRange) continue;
+
+        SightQuery query = { store.x[i], store.y[i], state.posX, state.posY };
+        queries.push_back(query);
+        askers.push_back(i);
+    }
+
+    answers.resize(queries.size());
+    checkSight(worldMap, visibilitySets, queries.data(), answers.data(), (int)queries.size());
+    for (size_t k = 0; k < askers.size(); k++) store.seesPlayer[askers[k]] = answers[k];
+}
+
+void shoot(GameState& state)
+{
+    if (state.canFire)
+    {
+        state.canFire = false;
+
+        state.gunTexture = 1;
+        state.shotsFired++;
+
+        HitscanRay ray;
+        ray.x = state.posX;
+        ray.y = state.posY;
+        ray.dirX = state.dirX;
+        ray.dirY = state.dirY;
+
+        HitscanResult hit = traceHitscan(state.entities, ray);
+        if (hit.kind == HIT_SPRITE && state.entities.texture[hit.sprite] == 1)
+        {
+            state.entities.texture[hit.sprite] = deadSpriteTexture;
+            state.entities.state[hit.sprite] = ENTITY_DEAD;
+            state.entities.velocityX[hit.sprite] = 0;
+            state.entities.velocityY[hit.sprite] = 0;
+        }
+    }
+}
+
+// Persistent worker pool for the render passes. The range is split into bands that are
+// dealt out to every thread up front, threads that run dry steal the leftovers of busy ones.
+class RenderPool
+{
+public:
+    ~RenderPool() { stop(); }
+
+    void start(int threadCount)
+    {
+        stop();
+        if (threadCount < 1) threadCount = 1;
+
+        queueCount = threadCount;
+        queues.reset(new BandQueue[queueCount]);
+        quitting = false;
+        for (int i = 1; i < threadCount; i++) workers.emplace_back(&RenderPool::workerLoop, this, i);
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quitting = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) worker.join();
+        workers.clear();
+    }
+
+    int threadCount() const { return (int)workers.size() + 1; }
+
+    // Calls job(start, end) for every band of [0, count) and returns once all bands are done
+    void run(int count, int bandSize, const std::function<void(int, int)>& job)
+    {
+        int bands = (count + bandSize - 1) / bandSize;
+        if (workers.empty() || bands <= 1)
+        {
+            if (count > 0) job(0, count);
+            return;
+        }
+
+        jobCount = count;
+        jobBandSize = bandSize;
+        currentJob = &job;
+        for (int i = 0; i < queueCount; i++)
+        {
+            queues[i].next = bands * i / queueCount;
+            queues[i].end = bands * (i + 1) / queueCount;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending = (int)workers.size();
+            generation++;
+        }
+        wake.notify_all();
+
+        runBands(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this] { return pending == 0; });
+        currentJob = NULL;
+    }
+
+private:
+    struct BandQueue
+    {
+        std::atomic<int> next{ 0 };
+        int end = 0;
+        char padding[56]; // Keep each queue on its own cache line
+    };
+
+    void runBands(int self)
+    {
+        // Own bands first, then steal from the other queues
+        for (int i = 0; i < queueCount; i++)
+        {
+            BandQueue& queue = queues[(self + i) % queueCount];
+            int band;
+            while ((band = queue.next.fetch_add(1)) < queue.end)
+            {
+                int start = band * jobBandSize;
+                (*currentJob)(start, std::min(jobCount, start + jobBandSize));
+            }
+        }
+    }
+
+    void workerLoop(int self)
+    {
+        int seen = 0;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return quitting || generation != seen; });
+                if (quitting) return;
+                seen = generation;
+            }
+
+            runBands(self);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0) finished.notify_one();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::unique_ptr<BandQueue[]> queues;
+    int queueCount = 0;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    int generation = 0;
+    int pending = 0;
+    bool quitting = false;
+
+    const std::function<void(int, int)>* currentJob = NULL;
+    int jobCount = 0;
+    int jobBandSize = 1;
+};
+
+RenderPool renderPool;
+const int renderBandSize = 16; // Columns per band
+
+// Screen-space footprint of a sprite, computed once per frame before the parallel draw
+struct SpriteProjection
+{
+    const Texture* texture;
+    double transformY;
+    int spriteScreenX;
+    int spriteWidth;
+    int spriteHeight;
+    int drawStartX;
+    int drawEndX;
+    int drawStartY;
+    int drawEndY;
+    int shade; // Light level of the sprite's cell, 0 for full light
+};
+
+// Where a view is seen from
+struct Camera
+{
+    double posX, posY;
+    double dirX, dirY;
+    double planeX, planeY;
+};
+
+// The player's view as it is drawn this frame
+Camera playerCamera()
+{
+    Camera camera = { posX, posY, dirX, dirY, planeX, planeY };
+    return camera;
+}
+
+// What views are drawn of. Only read while drawing, so any number of views can share one.
+// Textures come from the loaded wall and sprite textures.
+struct World
+{
+    const TileMap& map;
+    const EntityStore& entities;
+    const VisibilitySets& visibility; // Built from map
+    const LightMap& light; // Baked for map
+};
+
+// What a view is drawn into. The pixels belong to the caller, everything else is the scratch the
+// passes share for this view: each column's wall distance and the rows its wall covers, and the
+// sprites as projected for the camera. Nothing else is written while drawing, so views with a
+// framebuffer each can be drawn at the same time.
+struct Framebuffer
+{
+    Uint32* pixels = NULL;
+    int pitch = 0; // In pixels
+    int width = 0;
+    int height = 0;
+    Uint32 ceilingColor = 0; // Shown where no wall or ceiling texture is drawn
+    Uint32 floorColor = 0;
+
+    std::vector<double> zBuffer;
+    std::vector<int> wallTop; // Screen rows each column's wall covers, [wallTop, wallBottom), for the floor and ceiling pass
+    std::vector<int> wallBottom;
+
+    std::vector<SpriteProjection> sprites; // Visible sprites, farthest first
+
+    // Sprites that survived culling, farthest first. Kept between frames because the order
+    // barely changes, which keeps the insertion sort close to linear.
+    std::vector<int> spriteOrder;
+    std::vector<int> nextSpriteOrder;
+    std::vector<double> spriteDistance; // Squared distance to the camera, per sprite
+    std::vector<SpriteProjection> spriteProjections; // Per sprite, only valid while visible
+    std::vector<Uint8> spriteVisible;
+    std::vector<double> transformX; // Camera-space position of every entity
+    std::vector<double> transformY;
+    std::vector<Uint64> spriteCells; // Cells a sprite can stand in and still be seen from the camera's cell
+    std::vector<Uint64> spriteCellsScratch;
+
+    // Draws into width x height pixels in the given format, pitch in pixels
+    void attach(Uint32* target, int targetWidth, int targetHeight, int targetPitch, const SDL_PixelFormat* format)
+    {
+        pixels = target;
+        width = targetWidth;
+        height = targetHeight;
+        pitch = targetPitch;
+        ceilingColor = SDL_MapRGB(format, 0x00, 0x00, 0x00);
+        floorColor = SDL_MapRGB(format, 0x12, 0x12, 0x12);
+
+        if ((int)zBuffer.size() != width)
+        {
+            zBuffer.assign(width, 0);
+            wallTop.assign(width, 0);
+            wallBottom.assign(width, 0);
+        }
+    }
+};
+
+// The player's view, drawn into the view layer or the render target
+Framebuffer playerView;
+
+// State of one ray through the DDA, filled in by setupRay() and the tracers
+struct RayHit
+{
+    double rayDirX;
+    double rayDirY;
+    double sideDistX;
+    double sideDistY;
+    double deltaDistX;
+    double deltaDistY;
+    int mapX;
+    int mapY;
+    int stepX;
+    int stepY;
+    int hit;
+    int side;
+};
+
+// Column x of a view width pixels across
+void setupRay(const Camera& camera, int width, int x, RayHit& ray)
+{
+    double cameraX = 2 * x / (double)width - 1;
+    ray.rayDirX = camera.dirX + camera.planeX * cameraX;
+    ray.rayDirY = camera.dirY + camera.planeY * cameraX;
+
+    ray.mapX = int(camera.posX);
+    ray.mapY = int(camera.posY);
+
+    ray.deltaDistX = (ray.rayDirX == 0) ? 1e30 : std::abs(1 / ray.rayDirX);
+    ray.deltaDistY = (ray.rayDirY == 0) ? 1e30 : std::abs(1 / ray.rayDirY);
+
+    if (ray.rayDirX < 0)
+    {
+        ray.stepX = -1;
+        ray.sideDistX = (camera.posX - ray.mapX) * ray.deltaDistX;
+    }
+    else
+    {
+        ray.stepX = 1;
+        ray.sideDistX = (ray.mapX + 1.0 - camera.posX) * ray.deltaDistX;
+    }
+    if (ray.rayDirY < 0)
+    {
+        ray.stepY = -1;
+        ray.sideDistY = (camera.posY - ray.mapY) * ray.deltaDistY;
+    }
+    else
+    {
+        ray.stepY = 1;
+        ray.sideDistY = (ray.mapY + 1.0 - camera.posY) * ray.deltaDistY;
+    }
+
+    ray.hit = 0;
+    ray.side = 0;
+}
+
+// Number of distances start + n * delta, n >= 0, below limit, or not above it when inclusive.
+// The division only gives an estimate, the count is settled with the DDA's own arithmetic.
+inline int countSteps(double start, double delta, double limit, bool inclusive, int low, int high)
+{
+    double estimate = (limit - start) / delta;
+    int n = estimate < low ? low : (estimate > high ? high : (int)estimate);
+
+    while (n > low && !(inclusive ? start + (n - 1) * delta <= limit : start + (n - 1) * delta < limit)) n--;
+    while (n < high && (inclusive ? start + n * delta <= limit : start + n * delta < limit)) n++;
+    return n;
+}
+
+// Empty-space skipping. Every cell closer than the empty radius of the current cell is air, so
+// the DDA steps until the ray leaves that square are taken at once. The ray stops on the last cell
+// inside the square, the next regular step leaves it, so the hit cell, side and distances are the
+// same as stepping one cell at a time. Returns false when the skip would pass maxRayDistance.
+inline bool skipEmpty(int radius, double startX, double startY, double deltaX, double deltaY, int& stepsX, int& stepsY)
+{
+    int lastX = stepsX + radius - 1;
+    int lastY = stepsY + radius - 1;
+    double exitX = startX + lastX * deltaX; // Distance of the step leaving the square along X
+    double exitY = startY + lastY * deltaY;
+    if (std::min(exitX, exitY) > maxRayDistance) return false;
+
+    // Steps are taken in order of distance, Y first on a tie
+    if (exitX < exitY)
+    {
+        stepsY = countSteps(startY, deltaY, exitX, true, stepsY, lastY);
+        stepsX = lastX;
+    }
+    else
+    {
+        stepsX = countSteps(startX, deltaX, exitY, false, stepsX, lastX);
+        stepsY = lastY;
+    }
+    return true;
+}
+
+// DDA. Stops with hit 0 when the ray leaves the map or passes maxRayDistance. The side distances
+// are worked out from the number of steps rather than summed, so skipped steps land on the same values.
+void traceRay(RayHit& ray, const TileMap& map)
+{
+    const double startX = ray.sideDistX;
+    const double startY = ray.sideDistY;
+    int stepsX = 0;
+    int stepsY = 0;
+
+    for (;;)
+    {
+        double entered; // Distance at which the ray enters the next cell
+        if (ray.sideDistX < ray.sideDistY)
+        {
+            entered = ray.sideDistX;
+            stepsX++;
+            ray.sideDistX = startX + stepsX * ray.deltaDistX;
+            ray.mapX += ray.stepX;
+            ray.side = 0;
+        }
+        else
+        {
+            entered = ray.sideDistY;
+            stepsY++;
+            ray.sideDistY = startY + stepsY * ray.deltaDistY;
+            ray.mapY += ray.stepY;
+            ray.side = 1;
+        }
+
+        if (!map.contains(ray.mapX, ray.mapY)) break;
+
+        int cell = map.at(ray.mapX, ray.mapY);
+        if (cell > 0)
+        {
+            ray.hit = cell;
+            break;
+        }
+
+        if (entered > maxRayDistance) break;
+
+        int radius = map.emptyRadius(ray.mapX, ray.mapY);
+        if (radius > 1)
+        {
+            int oldStepsX = stepsX;
+            int oldStepsY = stepsY;
+            if (skipEmpty(radius, startX, startY, ray.deltaDistX, ray.deltaDistY, stepsX, stepsY))
+            {
+                ray.mapX += (stepsX - oldStepsX) * ray.stepX;
+                ray.mapY += (stepsY - oldStepsY) * ray.stepY;
+                ray.sideDistX = startX + stepsX * ray.deltaDistX;
+                ray.sideDistY = startY + stepsY * ray.deltaDistY;
+            }
+        }
+    }
+    if (ray.hit >= wallTypes) ray.hit = 1;
+}
+
+void tracePacketScalar(RayHit* rays, const TileMap& map)
+{
+    traceRay(rays[0], map);
+}
+
+// Packet DDA, traces adjacent columns together with masked stepping. Lanes that have stopped
+// are frozen and the packet retires once all of them have. The arithmetic and the stopping
+// rules are the same as traceRay() so the output does not change.
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define RAYCAST_SIMD
+
+#ifdef _MSC_VER
+#define TARGET_SSE41
+#define TARGET_AVX2
+#else
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+TARGET_SSE41 void tracePacketSSE41(RayHit* rays, const TileMap& map)
+{
+    const __m128d startX = _mm_set_pd(rays[1].sideDistX, rays[0].sideDistX);
+    const __m128d startY = _mm_set_pd(rays[1].sideDistY, rays[0].sideDistY);
+    __m128d sideDistX = startX;
+    __m128d sideDistY = startY;
+    __m128d countX = _mm_setzero_pd(); // Steps taken, kept as doubles for the side distances
+    __m128d countY = _mm_setzero_pd();
+    __m128d deltaDistX = _mm_set_pd(rays[1].deltaDistX, rays[0].deltaDistX);
+    __m128d deltaDistY = _mm_set_pd(rays[1].deltaDistY, rays[0].deltaDistY);
+    __m128i mapX = _mm_set_epi64x(rays[1].mapX, rays[0].mapX);
+    __m128i mapY = _mm_set_epi64x(rays[1].mapY, rays[0].mapY);
+    __m128i stepX = _mm_set_epi64x(rays[1].stepX, rays[0].stepX);
+    __m128i stepY = _mm_set_epi64x(rays[1].stepY, rays[0].stepY);
+    __m128i side = _mm_setzero_si128();
+    __m128i hit = _mm_setzero_si128();
+    __m128i active = _mm_set1_epi64x(-1);
+
+    const __m128d maxDistance = _mm_set1_pd(maxRayDistance);
+
+    do
+    {
+        __m128i xCloser = _mm_castpd_si128(_mm_cmplt_pd(sideDistX, sideDistY));
+        __m128d entered = _mm_blendv_pd(sideDistY, sideDistX, _mm_castsi128_pd(xCloser));
+        __m128i stepsX = _mm_and_si128(xCloser, active);
+        __m128i stepsY = _mm_andnot_si128(xCloser, active);
+
+        countX = _mm_add_pd(countX, _mm_and_pd(_mm_castsi128_pd(stepsX), _mm_set1_pd(1.0)));
+        countY = _mm_add_pd(countY, _mm_and_pd(_mm_castsi128_pd(stepsY), _mm_set1_pd(1.0)));
+        sideDistX = _mm_add_pd(startX, _mm_mul_pd(countX, deltaDistX));
+        sideDistY = _mm_add_pd(startY, _mm_mul_pd(countY, deltaDistY));
+        mapX = _mm_add_epi64(mapX, _mm_and_si128(stepX, stepsX));
+        mapY = _mm_add_epi64(mapY, _mm_and_si128(stepY, stepsY));
+        side = _mm_blendv_epi8(side, _mm_and_si128(stepsY, _mm_set1_epi64x(1)), active);
+
+        // Two lanes are cheaper to look up one by one than to gather
+        int activeLanes = _mm_movemask_pd(_mm_castsi128_pd(active));
+        int farLanes = _mm_movemask_pd(_mm_cmpgt_pd(entered, maxDistance));
+        int cells[2] = { 0, 0 };
+        Sint64 stops[2] = { 0, 0 };
+        int radius[2] = { 0, 0 };
+        for (int lane = 0; lane < 2; lane++)
+        {
+            if (!(activeLanes & (1 << lane))) continue;
+            int x = lane == 0 ? _mm_cvtsi128_si32(mapX) : _mm_extract_epi32(mapX, 2);
+            int y = lane == 0 ? _mm_cvtsi128_si32(mapY) : _mm_extract_epi32(mapY, 2);
+
+            if (!map.contains(x, y)) stops[lane] = -1;
+            else if ((cells[lane] = map.at(x, y)) > 0) stops[lane] = -1;
+            else if (farLanes & (1 << lane)) stops[lane] = -1;
+            else radius[lane] = map.emptyRadius(x, y);
+        }
+        __m128i stopNow = _mm_set_epi64x(stops[1], stops[0]);
+
+        if (radius[0] > 1 || radius[1] > 1)
+        {
+            alignas(16) double laneStartX[2], laneStartY[2], laneDeltaX[2], laneDeltaY[2], laneCountX[2], laneCountY[2];
+            alignas(16) long long laneMapX[2], laneMapY[2], laneStepX[2], laneStepY[2];
+            _mm_store_pd(laneStartX, startX);
+            _mm_store_pd(laneStartY, startY);
+            _mm_store_pd(laneDeltaX, deltaDistX);
+            _mm_store_pd(laneDeltaY, deltaDistY);
+            _mm_store_pd(laneCountX, countX);
+            _mm_store_pd(laneCountY, countY);
+            _mm_store_si128((__m128i*)laneMapX, mapX);
+            _mm_store_si128((__m128i*)laneMapY, mapY);
+            _mm_store_si128((__m128i*)laneStepX, stepX);
+            _mm_store_si128((__m128i*)laneStepY, stepY);
+
+            for (int lane = 0; lane < 2; lane++)
+            {
+                if (radius[lane] <= 1) continue;
+                int stepsTakenX = (int)laneCountX[lane];
+                int stepsTakenY = (int)laneCountY[lane];
+                if (!skipEmpty(radius[lane], laneStartX[lane], laneStartY[lane], laneDeltaX[lane], laneDeltaY[lane], stepsTakenX, stepsTakenY)) continue;
+
+                laneMapX[lane] += (stepsTakenX - (int)laneCountX[lane]) * laneStepX[lane];
+                laneMapY[lane] += (stepsTakenY - (int)laneCountY[lane]) * laneStepY[lane];
+                laneCountX[lane] = stepsTakenX;
+                laneCountY[lane] = stepsTakenY;
+            }
+
+            countX = _mm_load_pd(laneCountX);
+            countY = _mm_load_pd(laneCountY);
+            mapX = _mm_load_si128((const __m128i*)laneMapX);
+            mapY = _mm_load_si128((const __m128i*)laneMapY);
+            sideDistX = _mm_add_pd(startX, _mm_mul_pd(countX, deltaDistX));
+            sideDistY = _mm_add_pd(startY, _mm_mul_pd(countY, deltaDistY));
+        }
+
+        hit = _mm_blendv_epi8(hit, _mm_set_epi64x(cells[1], cells[0]), stopNow);
+        active = _mm_andnot_si128(stopNow, active);
+    } while (_mm_movemask_pd(_mm_castsi128_pd(active)) != 0);
+
+    for (int lane = 0; lane < 2; lane++)
+    {
+        RayHit& ray = rays[lane];
+        ray.sideDistX = lane == 0 ? _mm_cvtsd_f64(sideDistX) : _mm_cvtsd_f64(_mm_unpackhi_pd(sideDistX, sideDistX));
+        ray.sideDistY = lane == 0 ? _mm_cvtsd_f64(sideDistY) : _mm_cvtsd_f64(_mm_unpackhi_pd(sideDistY, sideDistY));
+        ray.mapX = lane == 0 ? _mm_cvtsi128_si32(mapX) : _mm_extract_epi32(mapX, 2);
+        ray.mapY = lane == 0 ? _mm_cvtsi128_si32(mapY) : _mm_extract_epi32(mapY, 2);
+        ray.side = lane == 0 ? _mm_cvtsi128_si32(side) : _mm_extract_epi32(side, 2);
+        ray.hit = lane == 0 ? _mm_cvtsi128_si32(hit) : _mm_extract_epi32(hit, 2);
+        if (ray.hit >= wallTypes) ray.hit = 1;
+    }
+}
+
+TARGET_AVX2 void tracePacketAVX2(RayHit* rays, const TileMap& map)
+{
+    const __m256d startX = _mm256_set_pd(rays[3].sideDistX, rays[2].sideDistX, rays[1].sideDistX, rays[0].sideDistX);
+    const __m256d startY = _mm256_set_pd(rays[3].sideDistY, rays[2].sideDistY, rays[1].sideDistY, rays[0].sideDistY);
+    __m256d sideDistX = startX;
+    __m256d sideDistY = startY;
+    __m256d countX = _mm256_setzero_pd(); // Steps taken, kept as doubles for the side distances
+    __m256d countY = _mm256_setzero_pd();
+    __m256d deltaDistX = _mm256_set_pd(rays[3].deltaDistX, rays[2].deltaDistX, rays[1].deltaDistX, rays[0].deltaDistX);
+    __m256d deltaDistY = _mm256_set_pd(rays[3].deltaDistY, rays[2].deltaDistY, rays[1].deltaDistY, rays[0].deltaDistY);
+    __m256i mapX = _mm256_set_epi64x(rays[3].mapX, rays[2].mapX, rays[1].mapX, rays[0].mapX);
+    __m256i mapY = _mm256_set_epi64x(rays[3].mapY, rays[2].mapY, rays[1].mapY, rays[0].mapY);
+    __m256i stepX = _mm256_set_epi64x(rays[3].stepX, rays[2].stepX, rays[1].stepX, rays[0].stepX);
+    __m256i stepY = _mm256_set_epi64x(rays[3].stepY, rays[2].stepY, rays[1].stepY, rays[0].stepY);
+    __m256i side = _mm256_setzero_si256();
+    __m256i hit = _mm256_setzero_si256();
+    __m256i active = _mm256_set1_epi64x(-1);
+
+    const __m256i tileColumns = _mm256_set1_epi64x(map.tileColumns());
+    const __m256i mapWidth = _mm256_set1_epi64x(map.width());
+    const __m256i mapHeight = _mm256_set1_epi64x(map.height());
+    const __m256i tileMask = _mm256_set1_epi64x(TileMap::tileMask);
+    const __m256i byteMask = _mm256_set1_epi64x(0xFF);
+    const __m256i minusOne = _mm256_set1_epi64x(-1);
+    const __m256d maxDistance = _mm256_set1_pd(maxRayDistance);
+    const __m256i lowDwords = _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi64x(1);
+    const __m256d oneStep = _mm256_set1_pd(1.0);
+
+    do
+    {
+        __m256i xCloser = _mm256_castpd_si256(_mm256_cmp_pd(sideDistX, sideDistY, _CMP_LT_OQ));
+        __m256d entered = _mm256_blendv_pd(sideDistY, sideDistX, _mm256_castsi256_pd(xCloser));
+        __m256i stepsX = _mm256_and_si256(xCloser, active);
+        __m256i stepsY = _mm256_andnot_si256(xCloser, active);
+
+        countX = _mm256_add_pd(countX, _mm256_and_pd(_mm256_castsi256_pd(stepsX), oneStep));
+        countY = _mm256_add_pd(countY, _mm256_and_pd(_mm256_castsi256_pd(stepsY), oneStep));
+        sideDistX = _mm256_add_pd(startX, _mm256_mul_pd(countX, deltaDistX));
+        sideDistY = _mm256_add_pd(startY, _mm256_mul_pd(countY, deltaDistY));
+        mapX = _mm256_add_epi64(mapX, _mm256_and_si256(stepX, stepsX));
+        mapY = _mm256_add_epi64(mapY, _mm256_and_si256(stepY, stepsY));
+        side = _mm256_blendv_epi8(side, _mm256_srli_epi64(stepsY, 63), active);
+
+        __m256i inside = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpgt_epi64(mapX, minusOne), _mm256_cmpgt_epi64(mapWidth, mapX)),
+            _mm256_and_si256(_mm256_cmpgt_epi64(mapY, minusOne), _mm256_cmpgt_epi64(mapHeight, mapY)));
+        __m256i walking = _mm256_and_si256(active, inside);
+
+        // Tiled index, same as TileMap::index()
+        __m256i tile = _mm256_add_epi64(_mm256_mul_epi32(_mm256_srli_epi64(mapX, TileMap::tileShift), tileColumns), _mm256_srli_epi64(mapY, TileMap::tileShift));
+        __m256i index = _mm256_or_si256(_mm256_slli_epi64(tile, 2 * TileMap::tileShift),
+            _mm256_or_si256(_mm256_slli_epi64(_mm256_and_si256(mapX, tileMask), TileMap::tileShift), _mm256_and_si256(mapY, tileMask)));
+
+        // Gather the cells of all lanes still walking inside the map
+        __m128i gatherMask = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(walking, lowDwords));
+        __m256i cell = _mm256_cvtepi32_epi64(_mm256_mask_i64gather_epi32(_mm_setzero_si128(), (const int*)map.data(), index, gatherMask, 1));
+        cell = _mm256_and_si256(cell, byteMask);
+
+        __m256i hitNow = _mm256_and_si256(_mm256_cmpgt_epi64(cell, zero), walking);
+        __m256i tooFar = _mm256_castpd_si256(_mm256_cmp_pd(entered, maxDistance, _CMP_GT_OQ));
+        __m256i stopNow = _mm256_and_si256(active, _mm256_or_si256(_mm256_andnot_si256(inside, minusOne), _mm256_or_si256(hitNow, tooFar)));
+
+        hit = _mm256_blendv_epi8(hit, cell, hitNow);
+        active = _mm256_andnot_si256(stopNow, active);
+
+        // Lanes on open ground jump across it, one lane at a time as the jumps differ
+        __m128i skipMask = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(active, lowDwords));
+        __m256i radius = _mm256_cvtepi32_epi64(_mm256_mask_i64gather_epi32(_mm_setzero_si128(), (const int*)map.emptyRadiusData(), index, skipMask, 1));
+        radius = _mm256_and_si256(_mm256_and_si256(radius, byteMask), active);
+        int skipLanes = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(radius, one)));
+        if (skipLanes != 0)
+        {
+            alignas(32) double laneStartX[4], laneStartY[4], laneDeltaX[4], laneDeltaY[4], laneCountX[4], laneCountY[4];
+            alignas(32) long long laneMapX[4], laneMapY[4], laneStepX[4], laneStepY[4], laneRadius[4];
+            _mm256_store_pd(laneStartX, startX);
+            _mm256_store_pd(laneStartY, startY);
+            _mm256_store_pd(laneDeltaX, deltaDistX);
+            _mm256_store_pd(laneDeltaY, deltaDistY);
+            _mm256_store_pd(laneCountX, countX);
+            _mm256_store_pd(laneCountY, countY);
+            _mm256_store_si256((__m256i*)laneMapX, mapX);
+            _mm256_store_si256((__m256i*)laneMapY, mapY);
+            _mm256_store_si256((__m256i*)laneStepX, stepX);
+            _mm256_store_si256((__m256i*)laneStepY, stepY);
+            _mm256_store_si256((__m256i*)laneRadius, radius);
+
+            for (int lane = 0; lane < 4; lane++)
+            {
+                if (!(skipLanes & (1 << lane))) continue;
+                int stepsTakenX = (int)laneCountX[lane];
+                int stepsTakenY = (int)laneCountY[lane];
+                if (!skipEmpty((int)laneRadius[lane], laneStartX[lane], laneStartY[lane], laneDeltaX[lane], laneDeltaY[lane], stepsTakenX, stepsTakenY)) continue;
+
+                laneMapX[lane] += (stepsTakenX - (int)laneCountX[lane]) * laneStepX[lane];
+                laneMapY[lane] += (stepsTakenY - (int)laneCountY[lane]) * laneStepY[lane];
+                laneCountX[lane] = stepsTakenX;
+                laneCountY[lane] = stepsTakenY;
+            }
+
+            countX = _mm256_load_pd(laneCountX);
+            countY = _mm256_load_pd(laneCountY);
+            mapX = _mm256_load_si256((const __m256i*)laneMapX);
+            mapY = _mm256_load_si256((const __m256i*)laneMapY);
+            sideDistX = _mm256_add_pd(startX, _mm256_mul_pd(countX, deltaDistX));
+            sideDistY = _mm256_add_pd(startY, _mm256_mul_pd(countY, deltaDistY));
+        }
+    } while (_mm256_movemask_pd(_mm256_castsi256_pd(active)) != 0);
+
+    alignas(32) double outSideDistX[4], outSideDistY[4];
+    alignas(32) long long outMapX[4], outMapY[4], outSide[4], outHit[4];
+    _mm256_store_pd(outSideDistX, sideDistX);
+    _mm256_store_pd(outSideDistY, sideDistY);
+    _mm256_store_si256((__m256i*)outMapX, mapX);
+    _mm256_store_si256((__m256i*)outMapY, mapY);
+    _mm256_store_si256((__m256i*)outSide, side);
+    _mm256_store_si256((__m256i*)outHit, hit);
+
+    for (int lane = 0; lane < 4; lane++)
+    {
+        RayHit& ray = rays[lane];
+        ray.sideDistX = outSideDistX[lane];
+        ray.sideDistY = outSideDistY[lane];
+        ray.mapX = (int)outMapX[lane];
+        ray.mapY = (int)outMapY[lane];
+        ray.side = (int)outSide[lane];
+        ray.hit = (int)outHit[lane];
+        if (ray.hit >= wallTypes) ray.hit = 1;
+    }
+}
+#endif
+
+// Picked at startup from the CPU features, see selectRayTracer()
+void (*tracePacket)(RayHit* rays, const TileMap& map) = tracePacketScalar;
+int rayPacketWidth = 1;
+const int maxRayPacketWidth = 4;
+
+// "auto" picks the widest kernel the CPU supports, "scalar", "sse41" and "avx2" force one
+void selectRayTracer(const std::string& preference)
+{
+    tracePacket = tracePacketScalar;
+    rayPacketWidth = 1;
+
+#ifdef RAYCAST_SIMD
+    bool automatic = preference == "auto";
+    if ((automatic || preference == "avx2") && SDL_HasAVX2())
+    {
+        tracePacket = tracePacketAVX2;
+        rayPacketWidth = 4;
+    }
+    else if ((automatic || preference == "sse41") && SDL_HasSSE41())
+    {
+        tracePacket = tracePacketSSE41;
+        rayPacketWidth = 2;
+    }
+#endif
+}
+
+const char* rayTracerName()
+{
+    switch (rayPacketWidth)
+    {
+    case 4: return "AVX2";
+    case 2: return "SSE4.1";
+    default: return "scalar";
+    }
+}
+
+// Draws a traced column, only touches its own pixels and column buffers so columns can run in parallel.
+// Returns the number of texels sampled.
+int drawColumn(const Camera& camera, const World& world, Framebuffer& view, int x, RayHit& ray)
+{
+    const TileMap& map = world.map;
+    int hit = ray.hit;
+    int side = ray.side;
+
+    // Door?
+    if (hit == 9)
+    {
+        if (side == 0)
+        {
+            ray.sideDistX += ray.deltaDistX / 2;
+
+            if (map.at(ray.mapX, ray.mapY) != 9)
+            {
+                ray.sideDistX -= ray.deltaDistX / 2;
+            }
+        }
+        else
+        {
+            ray.sideDistY += ray.deltaDistY / 2;
+
+            if (map.at(ray.mapX, ray.mapY) != 9)
+            {
+                ray.sideDistY -= ray.deltaDistY / 2;
+            }
+        }
+    }
+
+    double perpWallDist;
+    if (side == 0) perpWallDist = (ray.sideDistX - ray.deltaDistX);
+    else           perpWallDist = (ray.sideDistY - ray.deltaDistY);
+
+    // The ray left the map or gave up, leave the background showing
+    int height = view.height;
+    if (hit == 0)
+    {
+        view.zBuffer[x] = perpWallDist;
+        view.wallTop[x] = height / 2;
+        view.wallBottom[x] = height / 2;
+        return 0;
+    }
+
+    int lineHeight = (int)(height / perpWallDist);
+
+    double wallX; // Exactly where the wall was hit
+    if (side == 0) wallX = camera.posY + perpWallDist * ray.rayDirY;
+    else           wallX = camera.posX + perpWallDist * ray.rayDirX;
+    wallX -= floor((wallX));
+
+    int sampleX = (int)floor((wallX * wallTextureSize)) % wallTextureSize;
+
+    // Only walk the part of the column that lands inside the viewport
+    int columnTop = (height / 2) - (lineHeight / 2);
+    int firstY = (columnTop < 0) ? -columnTop : 0;
+    int lastY = (columnTop + lineHeight > height) ? height - columnTop : lineHeight;
+    view.wallTop[x] = columnTop + firstY;
+    view.wallBottom[x] = columnTop + lastY;
+
+    view.zBuffer[x] = perpWallDist;
+
+    const Texture& texture = *wallTextures[hit];
+    if (texture.colormap.empty() || lastY <= firstY) return 0;
+    // Distance fade plus the baked light of the face the ray came in through
+    int face = side == 0 ? (ray.stepX > 0 ? LightMap::FACE_MINUS_X : LightMap::FACE_PLUS_X) : (ray.stepY > 0 ? LightMap::FACE_MINUS_Y : LightMap::FACE_PLUS_Y);
+    int shade = std::min(lightLevel(perpWallDist) + world.light.faceShade(ray.mapX, ray.mapY, face), lightLevels - 1);
+    const Uint32* shades = texture.colormap.data() + (shade * 2 + side) * texture.palette.size();
+
+    // Drop to the smallest mip that still has at least one texel per pixel of the column
+    int level = 0;
+    while (level + 1 < (int)texture.mipOffsets.size() && (texture.h >> (level + 1)) >= lineHeight) level++;
+    int mipHeight = std::max(1, texture.h >> level);
+    const Uint16* column = texture.mips.data() + texture.mipOffsets[level] + (sampleX >> level) * mipHeight;
+
+    // 32.32 fixed point texel row. Rounding the step up lands on the same texel as
+    // floor(y * mipHeight / lineHeight) for any column shorter than 65536 pixels,
+    // taller ones round down so the last row never steps off the end of the column
+    Uint64 scaledHeight = (Uint64)mipHeight << 32;
+    Uint64 step = (lineHeight < 65536) ? (scaledHeight + lineHeight - 1) / lineHeight : scaledHeight / lineHeight;
+    Uint64 sampleY = firstY * step;
+    Uint32* pixel = view.pixels + (columnTop + firstY) * view.pitch + x;
+
+    for (int y = firstY; y < lastY; y++)
+    {
+        *pixel = shades[column[sampleY >> 32]];
+        sampleY += step;
+        pixel += view.pitch;
+    }
+
+    return lastY - firstY;
+}
+
+// Casts the columns [startX, endX) in packets of rayPacketWidth, the remainder one at a time
+void castColumns(const Camera& camera, const World& world, Framebuffer& view, int startX, int endX)
+{
+    RayHit rays[maxRayPacketWidth];
+    Uint64 ddaSteps = 0;
+    Uint64 texels = 0;
+
+    // Every DDA step moves one cell, so the steps taken are the Manhattan distance walked
+    int startMapX = int(camera.posX);
+    int startMapY = int(camera.posY);
+
+    int x = startX;
+    for (; x + rayPacketWidth <= endX; x += rayPacketWidth)
+    {
+        for (int lane = 0; lane < rayPacketWidth; lane++) setupRay(camera, view.width, x + lane, rays[lane]);
+        tracePacket(rays, world.map);
+        for (int lane = 0; lane < rayPacketWidth; lane++)
+        {
+            ddaSteps += abs(rays[lane].mapX - startMapX) + abs(rays[lane].mapY - startMapY);
+            texels += drawColumn(camera, world, view, x + lane, rays[lane]);
+        }
+    }
+    for (; x < endX; x++)
+    {
+        setupRay(camera, view.width, x, rays[0]);
+        traceRay(rays[0], world.map);
+        ddaSteps += abs(rays[0].mapX - startMapX) + abs(rays[0].mapY - startMapY);
+        texels += drawColumn(camera, world, view, x, rays[0]);
+    }
+
+    ddaStepCounter += ddaSteps;
+    texelCounter += texels;
+}
+
+// Texel indices and shaded palette of a floor or ceiling texture at a light level, NULL for flat cells
+inline void surfaceShades(int id, int level, const Uint16*& indices, const Uint32*& shades)
+{
+    const Texture* texture = id != 0 ? wallTextures[id < wallTypes ? id : 1].get() : NULL;
+    bool usable = texture && !texture->colormap.empty();
+    indices = usable ? texture->mips.data() : NULL;
+    shades = usable ? texture->colormap.data() + level * 2 * texture->palette.size() : NULL;
+}
+
+// Textured floor and ceiling, drawn after the walls a pair of rows at a time, row p below and
+// above the horizon. Every pixel of a row is the same distance away, so a row costs one
+// world-space step that is walked in 16.16 fixed point, and the distance fade is the same for
+// the whole row, the baked light only changes from cell to cell. Pixels covered by a wall are
+// left alone.
+void castSurfaceRows(const Camera& camera, const World& world, Framebuffer& view, int startRow, int endRow, int firstFloorY, int lastCeilingY)
+{
+    const TileMap& map = world.map;
+    const int fixedShift = 16;
+    const int textureShift = 6; // log2(wallTextureSize)
+    const int textureMask = wallTextureSize - 1;
+    const double fixedOne = 1 << fixedShift;
+
+    double rayDirX0 = camera.dirX - camera.planeX;
+    double rayDirY0 = camera.dirY - camera.planeY;
+    double rayDirX1 = camera.dirX + camera.planeX;
+    double rayDirY1 = camera.dirY + camera.planeY;
+    int width = view.width;
+    int height = view.height;
+    int horizon = height / 2;
+    bool shaded = world.light.isShaded();
+    Uint64 texels = 0;
+
+    for (int p = startRow; p < endRow; p++)
+    {
+        int floorY = horizon + p;
+        int ceilingY = horizon - p;
+        bool drawFloor = floorY < height && floorY >= firstFloorY;
+        bool drawCeiling = ceilingY >= 0 && ceilingY <= lastCeilingY;
+        if (!drawFloor && !drawCeiling) continue;
+
+        double rowDistance = 0.5 * height / p;
+        Sint64 worldX = (Sint64)floor((camera.posX + rowDistance * rayDirX0) * fixedOne);
+        Sint64 worldY = (Sint64)floor((camera.posY + rowDistance * rayDirY0) * fixedOne);
+        Sint64 stepX = (Sint64)(rowDistance * (rayDirX1 - rayDirX0) / width * fixedOne);
+        Sint64 stepY = (Sint64)(rowDistance * (rayDirY1 - rayDirY0) / width * fixedOne);
+        int level = lightLevel(rowDistance);
+
+        Uint32* floorRow = view.pixels + floorY * view.pitch;
+        Uint32* ceilingRow = view.pixels + ceilingY * view.pitch;
+
+        // Neighbouring pixels mostly share a cell, only look up its textures when it changes. Their
+        // tables only change with the texture, or on a lit map with the light.
+        int floorId = -1, ceilingId = -1;
+        int lastCellX = -1, lastCellY = -1;
+        int shade = level;
+        const Uint16* floorIndices = NULL;
+        const Uint16* ceilingIndices = NULL;
+        const Uint32* floorShades = NULL;
+        const Uint32* ceilingShades = NULL;
+
+        for (int x = 0; x < width; x++, worldX += stepX, worldY += stepY)
+        {
+            int cellX = (int)(worldX >> fixedShift);
+            int cellY = (int)(worldY >> fixedShift);
+            if (!map.contains(cellX, cellY)) continue;
+
+            if (cellX != lastCellX || cellY != lastCellY)
+            {
+                lastCellX = cellX;
+                lastCellY = cellY;
+                int cellLevel = shaded ? std::min(level + world.light.cellShade(cellX, cellY), lightLevels - 1) : level;
+                if (cellLevel != shade)
+                {
+                    shade = cellLevel;
+                    floorId = ceilingId = -1;
+                }
+
+                int id = drawFloor ? map.floorTexture(cellX, cellY) : 0;
+                if (id != floorId)
+                {
+                    floorId = id;
+                    surfaceShades(id, shade, floorIndices, floorShades);
+                }
+                id = drawCeiling ? map.ceilingTexture(cellX, cellY) : 0;
+                if (id != ceilingId)
+                {
+                    ceilingId = id;
+                    surfaceShades(id, shade, ceilingIndices, ceilingShades);
+                }
+            }
+
+            // Full size level of the column-major mip chain
+            int texel = (int)((worldX >> (fixedShift - textureShift)) & textureMask) * wallTextureSize + (int)((worldY >> (fixedShift - textureShift)) & textureMask);
+
+            if (drawFloor && floorY >= view.wallBottom[x])
+            {
+                if (floorIndices)
+                {
+                    floorRow[x] = floorShades[floorIndices[texel]];
+                    texels++;
+                }
+            }
+
+            if (drawCeiling && ceilingY < view.wallTop[x])
+            {
+                if (ceilingIndices)
+                {
+                    ceilingRow[x] = ceilingShades[ceilingIndices[texel]];
+                    texels++;
+                }
+            }
+        }
+    }
+
+    texelCounter += texels;
+}
+
+// Texture row sampled at screen row y of a view height pixels tall
+inline int spriteRow(int y, int spriteHeight, int height)
+{
+    int d = (y) * 256 - height * 128 + spriteHeight * 128; // 256 and 128 factors avoids using floats
+    int texY = ((d * texHeight) / spriteHeight) / 256;
+    return texY / 2;
+}
+
+// First screen row of the sprite that samples texture row `row` or below it
+int spriteRowStart(int row, const SpriteProjection& projection, int height)
+{
+    int y = (height - projection.spriteHeight) / 2 + row * 2 * projection.spriteHeight / texHeight;
+    y = std::max(projection.drawStartY, std::min(y, projection.drawEndY));
+
+    // The estimate is off by at most a row or two, settle it against the exact mapping
+    while (y > projection.drawStartY && spriteRow(y - 1, projection.spriteHeight, height) >= row) y--;
+    while (y < projection.drawEndY && spriteRow(y, projection.spriteHeight, height) < row) y++;
+    return y;
+}
+
+// Draws the projected sprites, farthest first, clipped to the columns [startX, endX).
+// Only the opaque spans of each texture column are visited.
+void drawSpriteBand(Framebuffer& view, int startX, int endX)
+{
+    Uint64 texels = 0;
+    int height = view.height;
+
+    for (const SpriteProjection& projection : view.sprites)
+    {
+        const Texture& texture = *projection.texture;
+        int spriteHeight = projection.spriteHeight;
+        int spriteWidth = projection.spriteWidth;
+
+        int firstSlice = std::max(projection.drawStartX, startX);
+        int lastSlice = std::min(projection.drawEndX, endX);
+
+        for (int slice = firstSlice; slice < lastSlice; slice++)
+        {
+            int texX = int(256 * (slice - (-spriteWidth / 2 + projection.spriteScreenX)) * texWidth / spriteWidth) / 256;
+            int column = texX / 2;
+            if (column >= texture.w) continue;
+
+            int firstSpan = texture.spanOffsets[column];
+            int lastSpan = texture.spanOffsets[column + 1];
+            if (firstSpan == lastSpan) continue; // Fully transparent column
+
+            if (projection.transformY > 0 && slice > 0 && slice < view.width && projection.transformY < view.zBuffer[slice])
+            {
+                const Uint16* columnTexels = texture.columns.data() + column * texture.h;
+                const Uint32* shades = texture.shadedPalette(projection.shade);
+
+                for (int s = firstSpan; s < lastSpan; s++)
+                {
+                    int spanStartY = spriteRowStart(texture.spans[s].start, projection, height);
+                    int spanEndY = spriteRowStart(texture.spans[s].end, projection, height);
+
+                    Uint32* pixel = view.pixels + spanStartY * view.pitch + slice;
+                    for (int y = spanStartY; y < spanEndY; y++)
+                    {
+                        *pixel = shades[columnTexels[spriteRow(y, spriteHeight, height)]];
+                        pixel += view.pitch;
+                    }
+                    texels += spanEndY - spanStartY;
+                }
+            }
+        }
+    }
+
+    texelCounter += texels;
+}
+
+// Largest sprite drawn, in pixels. The integer texture mapping in drawSpriteBand() stays inside
+// 32 bits up to this size, anything bigger is a sprite right on top of the camera.
+const int maxSpriteSize = 1 << 16;
+
+// Farthest first, equal distances by the higher index
+inline bool drawsBefore(const double* distance, int a, int b)
+{
+    if (distance[a] != distance[b]) return distance[a] > distance[b];
+    return a > b;
+}
+
+void sortSprites(std::vector<int>& order, const double* distance)
+{
+    for (size_t i = 1; i < order.size(); i++)
+    {
+        int current = order[i];
+        size_t j = i;
+        while (j > 0 && drawsBefore(distance, current, order[j - 1]))
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = current;
+    }
+}
+
+// Transforms every sprite into camera space once, culls the ones behind the camera, off
+// screen or hidden behind walls and sorts the rest into view.sprites. Needs the view's zBuffer.
+void projectSprites(const Camera& camera, const World& world, Framebuffer& view)
+{
+    int count = world.entities.size();
+    if ((int)view.spriteVisible.size() < count)
+    {
+        view.spriteVisible.resize(count);
+        view.spriteDistance.resize(count);
+        view.spriteProjections.resize(count);
+        view.transformX.resize(count);
+        view.transformY.resize(count);
+    }
+
+    // Per-frame camera constants, in locals so the stores below can't alias them
+    const double cameraX = camera.posX, cameraY = camera.posY;
+    const double viewDirX = camera.dirX, viewDirY = camera.dirY;
+    const double viewPlaneX = camera.planeX, viewPlaneY = camera.planeY;
+    const int width = view.width, height = view.height;
+    double invDet = 1.0 / (viewPlaneX * viewDirY - viewDirX * viewPlaneY);
+    double farthestWall = *std::max_element(view.zBuffer.begin(), view.zBuffer.end());
+    Uint64 culled = 0;
+
+    // Cells seen from the camera's cell, grown by how far a billboard reaches past the cell its
+    // sprite stands in (half its width, plane length * height / width) plus half a cell for
+    // rounding, so one bit tells if a sprite can show up at all
+    int cameraCellX = int(cameraX), cameraCellY = int(cameraY);
+    const Uint64* spriteCells = NULL;
+    if (world.map.contains(cameraCellX, cameraCellY) && world.map.at(cameraCellX, cameraCellY) == 0)
+    {
+        double planeLength = sqrt(viewPlaneX * viewPlaneX + viewPlaneY * viewPlaneY);
+        int reach = (int)ceil(planeLength * height / width + 0.5);
+        if (world.visibility.spreadRow(cameraCellX, cameraCellY, reach, view.spriteCells, view.spriteCellsScratch)) spriteCells = view.spriteCells.data();
+    }
+    const int mapWidth = world.map.width(), mapHeight = world.map.height();
+
+    // Bulk pass over the position arrays, branch free so it vectorizes
+    const double* entityX = world.entities.x.data();
+    const double* entityY = world.entities.y.data();
+    double* transformXs = view.transformX.data();
+    double* transformYs = view.transformY.data();
+    double* distances = view.spriteDistance.data();
+    for (int i = 0; i < count; i++)
+    {
+        double spriteX = entityX[i] - cameraX;
+        double spriteY = entityY[i] - cameraY;
+
+        transformXs[i] = invDet * (viewDirY * spriteX - viewDirX * spriteY);
+        transformYs[i] = invDet * (-viewPlaneY * spriteX + viewPlaneX * spriteY);
+        distances[i] = ((cameraX - entityX[i]) * (cameraX - entityX[i]) + (cameraY - entityY[i]) * (cameraY - entityY[i])); //sqrt not taken, unneeded
+    }
+
+    Uint8* visible = view.spriteVisible.data();
+    for (int i = 0; i < count; i++)
+    {
+        visible[i] = 0;
+
+        // In a part of the map the camera's cell can't see
+        int cellX = int(entityX[i]), cellY = int(entityY[i]);
+        if (spriteCells && (unsigned)cellX < (unsigned)mapWidth && (unsigned)cellY < (unsigned)mapHeight
+            && !VisibilitySets::test(spriteCells, cellX * mapHeight + cellY))
+        {
+            culled++;
+            continue;
+        }
+
+        // Behind the camera, too close to it or further than every wall
+        double transformX = transformXs[i];
+        double transformY = transformYs[i];
+        if (transformY * maxSpriteSize < height || transformY >= farthestWall)
+        {
+            culled++;
+            continue;
+        }
+
+        const Texture* texture = world.entities.textureOf(i);
+        if (!texture || texture->pixels.empty())
+        {
+            culled++;
+            continue;
+        }
+
+        int spriteScreenX = int((width / 2) * (1 + transformX / transformY));
+
+        int spriteHeight = abs(int(height / (transformY)));
+
+        int drawStartY = -spriteHeight / 2 + height / 2;
+        if (drawStartY < 0) drawStartY = 0;
+        int drawEndY = spriteHeight / 2 + height / 2;
+        if (drawEndY >= height) drawEndY = height - 1;
+
+        int spriteWidth = abs(int(height / (transformY)));
+        int drawStartX = -spriteWidth / 2 + spriteScreenX;
+        if (drawStartX < 0) drawStartX = 0;
+        int drawEndX = spriteWidth / 2 + spriteScreenX;
+        if (drawEndX >= width) drawEndX = width - 1;
+
+        // Outside the frustum
+        if (drawStartX >= drawEndX || drawStartY >= drawEndY)
+        {
+            culled++;
+            continue;
+        }
+
+        // Hidden behind walls across its whole width
+        bool inFront = false;
+        for (int slice = std::max(drawStartX, 1); slice < drawEndX && !inFront; slice++)
+        {
+            if (transformY < view.zBuffer[slice]) inFront = true;
+        }
+        if (!inFront)
+        {
+            culled++;
+            continue;
+        }
+
+        // Sprites aren't faded by distance, only by the light where they stand
+        int shade = 0;
+        if (world.light.isShaded() && (unsigned)cellX < (unsigned)mapWidth && (unsigned)cellY < (unsigned)mapHeight) shade = world.light.cellShade(cellX, cellY);
+
+        view.spriteProjections[i] = { texture, transformY, spriteScreenX, spriteWidth, spriteHeight, drawStartX, drawEndX, drawStartY, drawEndY, shade };
+        visible[i] = 1;
+    }
+
+    spritesCulledCounter += culled;
+
+    // Keep last frame's order for sprites that are still visible, then append the new ones
+    view.nextSpriteOrder.clear();
+    for (int index : view.spriteOrder)
+    {
+        if (index < count && visible[index] == 1)
+        {
+            view.nextSpriteOrder.push_back(index);
+            visible[index] = 2;
+        }
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (visible[i] == 1) view.nextSpriteOrder.push_back(i);
+    }
+    view.spriteOrder.swap(view.nextSpriteOrder);
+
+    sortSprites(view.spriteOrder, distances);
+
+    view.sprites.clear();
+    for (int index : view.spriteOrder) view.sprites.push_back(view.spriteProjections[index]);
+}
+
+// Fills the top half of the view with the ceiling colour and the bottom half with the floor colour
+void clearView(Framebuffer& view)
+{
+    for (int y = 0; y < view.height; y++)
+    {
+        Uint32* row = view.pixels + (size_t)y * view.pitch;
+        std::fill(row, row + view.width, y < view.height / 2 ? view.ceilingColor : view.floorColor);
+    }
+}
+
+// Rows nearer the horizon than every wall's edge are covered all the way across
+void surfaceRowLimits(const Framebuffer& view, int& firstFloorY, int& lastCeilingY)
+{
+    firstFloorY = *std::min_element(view.wallBottom.begin(), view.wallBottom.end());
+    lastCeilingY = *std::max_element(view.wallTop.begin(), view.wallTop.end()) - 1;
+}
+
+// Draws one whole view on the calling thread. Only the framebuffer is written, so views with a
+// framebuffer each can be drawn at once, see renderViews().
+void render(const Camera& camera, const World& world, Framebuffer& view)
+{
+    clearView(view);
+    castColumns(camera, world, view, 0, view.width);
+
+    if (world.map.hasSurfaceTextures())
+    {
+        int firstFloorY, lastCeilingY;
+        surfaceRowLimits(view, firstFloorY, lastCeilingY);
+        castSurfaceRows(camera, world, view, 1, view.height - view.height / 2 + 1, firstFloorY, lastCeilingY);
+    }
+
+    projectSprites(camera, world, view);
+    drawSpriteBand(view, 0, view.width);
+}
+
+// Draws count views of one world, each camera into the framebuffer at the same index. The views
+// are shared out over the render pool a whole view at a time. Runs on the thread that draws the
+// frames, between frames, as the pool takes one job at a time.
+void renderViews(const Camera* cameras, Framebuffer* views, int count, const World& world)
+{
+    renderPool.run(count, 1, [&](int start, int end) {
+        for (int i = start; i < end; i++) render(cameras[i], world, views[i]);
+    });
+}
+
+// Scaling from the render target into the viewport. Bilinear also box filters a 2x supersampled view.
+enum UpscaleFilter
+{
+    UPSCALE_NEAREST,
+    UPSCALE_BILINEAR
+};
+
+UpscaleFilter upscaleFilter = UPSCALE_BILINEAR;
+
+// Offscreen surface the view is rendered into when the render scale is not 1, sized for the largest scale
+SDL_Surface* renderTarget = NULL;
+
+// Source column and 8 bit blend weight for every viewport column or row
+struct UpscaleTap
+{
+    int index;
+    int next;
+    Uint32 weight;
+};
+
+std::vector<UpscaleTap> upscaleColumns;
+std::vector<UpscaleTap> upscaleRows;
+
+// Maps destination pixel centers onto the source in 16.16 fixed point
+void buildUpscaleTaps(std::vector<UpscaleTap>& taps, int destinationSize, int sourceSize)
+{
+    taps.resize(destinationSize);
+    Sint64 step = ((Sint64)sourceSize << 16) / destinationSize;
+    Sint64 position = step / 2;
+    if (upscaleFilter == UPSCALE_BILINEAR) position -= 1 << 15;
+
+    for (int i = 0; i < destinationSize; i++, position += step)
+    {
+        Sint64 clamped = std::max<Sint64>(0, std::min<Sint64>(position, (Sint64)(sourceSize - 1) << 16));
+        taps[i].index = (int)(clamped >> 16);
+        taps[i].next = std::min(taps[i].index + 1, sourceSize - 1);
+        taps[i].weight = upscaleFilter == UPSCALE_BILINEAR ? (Uint32)(clamped >> 8) & 0xFF : 0;
+    }
+}
+
+// Blends two packed pixels, red and blue share one multiply and green and alpha the other
+inline Uint32 blendPixels(Uint32 a, Uint32 b, Uint32 weight)
+{
+    Uint32 inverse = 256 - weight;
+    Uint32 redBlue = ((a & 0x00FF00FF) * inverse + (b & 0x00FF00FF) * weight) >> 8;
+    Uint32 greenAlpha = ((a >> 8) & 0x00FF00FF) * inverse + ((b >> 8) & 0x00FF00FF) * weight;
+    return (redBlue & 0x00FF00FF) | (greenAlpha & 0xFF00FF00);
+}
+
+// Scales a band of viewport rows from the render target
+void upscaleBand(int startRow, int endRow, const Uint32* source, int sourcePitch, Uint32* destination, int destinationPitch)
+{
+    const UpscaleTap* columns = upscaleColumns.data();
+
+    static thread_local std::vector<Uint32> blended;
+    blended.resize(renderWidth);
+    int blendedIndex = -1;
+    Uint32 blendedWeight = 0;
+
+    for (int y = startRow; y < endRow; y++)
+    {
+        const UpscaleTap& row = upscaleRows[y];
+        const Uint32* top = source + (size_t)row.index * sourcePitch;
+        Uint32* out = destination + (size_t)y * destinationPitch;
+
+        if (upscaleFilter == UPSCALE_NEAREST)
+        {
+            for (int x = 0; x < screenWidth; x++) out[x] = top[columns[x].index];
+            continue;
+        }
+
+        // Vertical pass once per source column, neighbouring viewport rows often share it
+        if (row.index != blendedIndex || row.weight != blendedWeight)
+        {
+            const Uint32* bottom = source + (size_t)row.next * sourcePitch;
+            for (int x = 0; x < renderWidth; x++) blended[x] = blendPixels(top[x], bottom[x], row.weight);
+            blendedIndex = row.index;
+            blendedWeight = row.weight;
+        }
+        for (int x = 0; x < screenWidth; x++)
+        {
+            const UpscaleTap& column = columns[x];
+            out[x] = blendPixels(blended[column.index], blended[column.next], column.weight);
+        }
+    }
+}
+
+// Allocates the render target once the window surface exists. Not needed at a fixed scale of 1.
+bool createRenderTarget()
+{
+    if (renderTarget || (maxRenderScale == 1.0 && renderScale == 1.0 && !resolutionController.enabled())) return true;
+
+    int width = (int)(screenWidth * maxRenderScale + 0.5);
+    int height = (int)(viewHeight * maxRenderScale + 0.5);
+    renderTarget = SDL_CreateRGBSurfaceWithFormat(0, std::max(16, width), std::max(16, height), 32, screenSurface->format->format);
+    if (renderTarget == NULL)
+    {
+        printf("Failed to create render target! SDL_Error: %s\n", SDL_GetError());
+        setRenderScale(1.0);
+        maxRenderScale = 1.0;
+        return false;
+    }
+    return true;
+}
+
+bool createLayers()
+{
+    viewLayer = SDL_CreateRGBSurfaceWithFormat(0, screenWidth, viewHeight, 32, screenSurface->format->format);
+    hudLayer = SDL_CreateRGBSurfaceWithFormat(0, screenWidth, hudHeight, 32, screenSurface->format->format);
+    if (viewLayer == NULL || hudLayer == NULL)
+    {
+        printf("Failed to create frame layers! SDL_Error: %s\n", SDL_GetError());
+        return false;
+    }
+    return true;
+}
+
+void freeRenderSurfaces()
+{
+    if (renderTarget) SDL_FreeSurface(renderTarget);
+    if (viewLayer) SDL_FreeSurface(viewLayer);
+    if (hudLayer) SDL_FreeSurface(hudLayer);
+    renderTarget = viewLayer = hudLayer = NULL;
+}
+
+// Copies rect of destination from source, where it sits at (sourceX, sourceY). Both surfaces
+// have the window's pixel format. Whatever part of the rect is off either surface is left out.
+void copyPixels(SDL_Surface* source, int sourceX, int sourceY, SDL_Surface* destination, const SDL_Rect& rect)
+{
+    // The source's bounds in destination coordinates
+    SDL_Rect destinationBounds = { 0, 0, destination->w, destination->h };
+    SDL_Rect sourceBounds = { rect.x - sourceX, rect.y - sourceY, source->w, source->h };
+    SDL_Rect onDestination, clipped;
+    if (!SDL_IntersectRect(&rect, &destinationBounds, &onDestination) || !SDL_IntersectRect(&onDestination, &sourceBounds, &clipped)) return;
+    sourceX += clipped.x - rect.x;
+    sourceY += clipped.y - rect.y;
+
+    if (SDL_MUSTLOCK(source)) SDL_LockSurface(source);
+    if (SDL_MUSTLOCK(destination)) SDL_LockSurface(destination);
+
+    const Uint8* from = (const Uint8*)source->pixels + (size_t)sourceY * source->pitch + sourceX * sizeof(Uint32);
+    Uint8* to = (Uint8*)destination->pixels + (size_t)clipped.y * destination->pitch + clipped.x * sizeof(Uint32);
+    size_t rowBytes = (size_t)clipped.w * sizeof(Uint32);
+    for (int y = 0; y < clipped.h; y++) memcpy(to + (size_t)y * destination->pitch, from + (size_t)y * source->pitch, rowBytes);
+
+    if (SDL_MUSTLOCK(destination)) SDL_UnlockSurface(destination);
+    if (SDL_MUSTLOCK(source)) SDL_UnlockSurface(source);
+}
+
+// Smallest rect holding both, empty rects are left out
+SDL_Rect unionRect(const SDL_Rect& a, const SDL_Rect& b)
+{
+    if (a.w <= 0 || a.h <= 0) return b;
+    if (b.w <= 0 || b.h <= 0) return a;
+    int left = std::min(a.x, b.x), top = std::min(a.y, b.y);
+    int right = std::max(a.x + a.w, b.x + b.w), bottom = std::max(a.y + a.h, b.y + b.h);
+    SDL_Rect both = { left, top, right - left, bottom - top };
+    return both;
+}
+
+// What a frame shows, so the next frame drawn over it only redoes what differs
+struct FrameContents
+{
+    Uint64 view = 0; // viewVersion, 0 before anything was drawn
+    Uint64 hud = 0; // hudVersion
+    int gun = -1;
+    SDL_Rect gunRect = {};
+    bool overlay = false;
+};
+
+// The rects that differ between two frames, at most four: the view or where the gun was and is,
+// and the HUD or the face and counter slots
+const int maxFrameChanges = 4;
+int frameChanges(const FrameContents& before, const FrameContents& after, SDL_Rect* rects)
+{
+    int count = 0;
+    if (before.view != after.view || before.overlay || after.overlay)
+    {
+        SDL_Rect view = { 0, 0, screenWidth, viewHeight };
+        rects[count++] = view;
+    }
+    else if (before.gun != after.gun || memcmp(&before.gunRect, &after.gunRect, sizeof(SDL_Rect)) != 0)
+    {
+        SDL_Rect gun = unionRect(before.gunRect, after.gunRect);
+        if (gun.w > 0 && gun.h > 0) rects[count++] = gun;
+    }
+
+    if (before.hud != after.hud)
+    {
+        if (before.hud == 0)
+        {
+            SDL_Rect hud = { 0, viewHeight, screenWidth, hudHeight };
+            rects[count++] = hud;
+        }
+        else
+        {
+            SDL_Rect slots[3] = { faceSlot(), ammoSlot(), healthSlot() };
+            for (int i = 0; i < 3; i++)
+            {
+                slots[i].y += viewHeight;
+                if (slots[i].w > 0 && slots[i].h > 0) rects[count++] = slots[i];
+            }
+        }
+    }
+    return count;
+}
+
+// What each frame buffer and the window hold. The window is always the last frame submitted,
+// a buffer may be a few frames behind.
+std::map<SDL_Surface*, FrameContents> bufferContents;
+FrameContents windowContents;
+
+// Hands finished frames to a copy thread so the window copy overlaps drawing the next frame.
+// Frames are drawn into a ring of offscreen buffers. The count of presented frames is the fence:
+// a buffer is drawn into again only once the frame it held last is on screen. The thread only
+// copies pixels into the window surface, SDL wants the window update itself on the thread that
+// made the window, so the main thread presents copied frames whenever it comes through here.
+// With a single buffer frames go straight to the window surface and are presented in place.
+// Only the rects that changed since the last frame are copied and pushed to the window.
+class PresentChain
+{
+public:
+    static const int maxBuffers = 3;
+
+    ~PresentChain() { stop(); }
+
+    // Needs the window surface. Fewer than 2 buffers, or a failed allocation, presents synchronously.
+    void start(int count)
+    {
+        stop();
+        bufferCount = 0;
+        submitted = 0;
+        copied = 0;
+        presented = 0;
+        quitting = false;
+        if (count < 2) return;
+
+        for (int i = 0; i < std::min(count, maxBuffers); i++)
+        {
+            buffers[i] = SDL_CreateRGBSurfaceWithFormat(0, screenSurface->w, screenSurface->h, 32, screenSurface->format->format);
+            if (buffers[i] == NULL)
+            {
+                printf("Failed to create frame buffer! SDL_Error: %s\n", SDL_GetError());
+                freeBuffers(i);
+                return;
+            }
+        }
+        bufferCount = std::min(count, maxBuffers);
+        copier = std::thread(&PresentChain::copyLoop, this);
+    }
+
+    // Presents whatever is still queued and frees the buffers
+    void stop()
+    {
+        if (!copier.joinable()) return;
+        flush();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quitting = true;
+        }
+        copyWanted.notify_all();
+        copier.join();
+        freeBuffers(bufferCount);
+        bufferCount = 0;
+    }
+
+    // Waits on the fence of the next buffer and returns it for drawing
+    SDL_Surface* acquire()
+    {
+        if (bufferCount == 0) return screenSurface;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            presentCopied(lock);
+            if (submitted - presented < (Uint64)bufferCount) return buffers[submitted % bufferCount];
+            frameCopied.wait(lock, [this] { return copied > presented; });
+        }
+    }
+
+    // Queues the buffer from acquire() for the copy thread, rects are the parts that changed
+    void submit(const SDL_Rect* rects, int count)
+    {
+        if (bufferCount == 0)
+        {
+            SDL_UpdateWindowSurfaceRects(window, rects, count);
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        changedRects[submitted % bufferCount].assign(rects, rects + count);
+        submitted++;
+        copyWanted.notify_one();
+        presentCopied(lock);
+    }
+
+    // Waits until every submitted frame is on screen
+    void flush()
+    {
+        if (bufferCount == 0) return;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            presentCopied(lock);
+            if (presented == submitted) return;
+            frameCopied.wait(lock, [this] { return copied > presented; });
+        }
+    }
+
+private:
+    // Main thread only. Pushes the frames the copy thread is done with to the window.
+    void presentCopied(std::unique_lock<std::mutex>& lock)
+    {
+        while (copied > presented)
+        {
+            const std::vector<SDL_Rect>& rects = changedRects[presented % bufferCount];
+            lock.unlock();
+            SDL_UpdateWindowSurfaceRects(window, rects.data(), (int)rects.size());
+            lock.lock();
+
+            presented++;
+            copyWanted.notify_one();
+        }
+    }
+
+    // The window surface holds one frame at a time, so the next copy waits for the last one to be presented
+    void copyLoop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            copyWanted.wait(lock, [this] { return quitting || (copied < submitted && copied == presented); });
+            if (quitting) return; // stop() flushed everything first
+
+            SDL_Surface* frame = buffers[copied % bufferCount];
+            const std::vector<SDL_Rect>& rects = changedRects[copied % bufferCount];
+            lock.unlock();
+            for (const SDL_Rect& rect : rects) copyPixels(frame, rect.x, rect.y, screenSurface, rect);
+            lock.lock();
+
+            copied++;
+            frameCopied.notify_all();
+        }
+    }
+
+    void freeBuffers(int count)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            SDL_FreeSurface(buffers[i]);
+            buffers[i] = NULL;
+        }
+    }
+
+    SDL_Surface* buffers[maxBuffers] = {};
+    std::vector<SDL_Rect> changedRects[maxBuffers]; // Only written for a buffer that is on screen already
+    int bufferCount = 0;
+    Uint64 submitted = 0;
+    Uint64 copied = 0; // In the window surface, waiting for the main thread to present them
+    Uint64 presented = 0;
+
+    std::mutex mutex;
+    std::condition_variable copyWanted;
+    std::condition_variable frameCopied;
+    std::thread copier;
+    bool quitting = false;
+};
+const int PresentChain::maxBuffers;
+
+PresentChain presentChain;
+int presentBuffers = 2;
+
+// What the view layer was drawn from, the camera and the sprites as they were projected
+struct ViewKey
+{
+    double posX, posY, dirX, dirY, planeX, planeY;
+    int width, height;
+};
+ViewKey drawnView = {};
+std::vector<SpriteProjection> drawnSprites;
+
+inline bool sameProjection(const SpriteProjection& a, const SpriteProjection& b)
+{
+    return a.texture == b.texture && a.transformY == b.transformY && a.spriteScreenX == b.spriteScreenX && a.spriteWidth == b.spriteWidth &&
+        a.spriteHeight == b.spriteHeight && a.drawStartX == b.drawStartX && a.drawEndX == b.drawEndX && a.drawStartY == b.drawStartY && a.drawEndY == b.drawEndY && a.shade == b.shade;
+}
+
+// With the camera where it was the walls can't have changed, and the zBuffer they left still
+// holds, so the sprites are projected again and compared with the ones in the view layer. Sprites
+// moving where they can't be seen don't count. Sets projected when playerView.sprites is up to date.
+bool viewChanged(bool& projected)
+{
+    ViewKey view = { posX, posY, dirX, dirY, planeX, planeY, renderWidth, renderHeight };
+    projected = false;
+    if (!viewInvalid && memcmp(&view, &drawnView, sizeof(view)) == 0)
+    {
+        ScopedTimer timer(STAGE_SPRITE_SORT);
+
+        World world = { worldMap, entities, visibilitySets, lightMap };
+        projectSprites(playerCamera(), world, playerView);
+        projected = true;
+        const std::vector<SpriteProjection>& sprites = playerView.sprites;
+        if (sprites.size() == drawnSprites.size() && std::equal(sprites.begin(), sprites.end(), drawnSprites.begin(), sameProjection)) return false;
+    }
+
+    viewInvalid = false;
+    drawnView = view;
+    return true;
+}
+
+// Casts the walls, floors and sprites into the view layer, the same passes as render() with each
+// one split into bands over the render pool. The sprites may already be projected for this
+// camera, see viewChanged().
+void drawView(bool projected)
+{
+    // At a scale of 1 the view is cast straight into the view layer, otherwise through the render target
+    bool scaled = renderTarget && (renderWidth != screenWidth || renderHeight != viewHeight);
+    SDL_Surface* target = scaled ? renderTarget : viewLayer;
+
+    Camera camera = playerCamera();
+    World world = { worldMap, entities, visibilitySets, lightMap };
+
+    // Lock once for the whole frame, the wall and sprite passes write straight into the framebuffer.
+    // The clear is outside every stage, the wall cast only times the rays and columns.
+    if (SDL_MUSTLOCK(target)) SDL_LockSurface(target);
+    playerView.attach((Uint32*)target->pixels, renderWidth, renderHeight, target->pitch / sizeof(Uint32), target->format);
+    clearView(playerView);
+
+    {
+        ScopedTimer timer(STAGE_WALL_CAST);
+
+        // RAYCAST
+        renderPool.run(renderWidth, renderBandSize, [&](int startX, int endX) {
+            castColumns(camera, world, playerView, startX, endX);
+        });
+    }
+
+    if (worldMap.hasSurfaceTextures())
+    {
+        ScopedTimer timer(STAGE_FLOOR_CAST);
+
+        int firstFloorY, lastCeilingY;
+        surfaceRowLimits(playerView, firstFloorY, lastCeilingY);
+
+        renderPool.run(renderHeight - renderHeight / 2, renderBandSize, [&](int startRow, int endRow) {
+            castSurfaceRows(camera, world, playerView, startRow + 1, endRow + 1, firstFloorY, lastCeilingY);
+        });
+    }
+
+    // SPRITECAST
+
+    // Culling and sorting
+    {
+        ScopedTimer timer(STAGE_SPRITE_SORT);
+
+        if (!projected) projectSprites(camera, world, playerView);
+        drawnSprites = playerView.sprites;
+    }
+
+    {
+        ScopedTimer timer(STAGE_SPRITE_DRAW);
+
+        renderPool.run(renderWidth, renderBandSize, [&](int startX, int endX) {
+            drawSpriteBand(playerView, startX, endX);
+        });
+    }
+
+    if (scaled)
+    {
+        ScopedTimer timer(STAGE_UPSCALE);
+
+        buildUpscaleTaps(upscaleColumns, screenWidth, renderWidth);
+        buildUpscaleTaps(upscaleRows, viewHeight, renderHeight);
+
+        if (SDL_MUSTLOCK(viewLayer)) SDL_LockSurface(viewLayer);
+        Uint32* viewPixels = (Uint32*)viewLayer->pixels;
+        int viewPitch = viewLayer->pitch / sizeof(Uint32);
+
+        renderPool.run(viewHeight, renderBandSize, [&](int startRow, int endRow) {
+            upscaleBand(startRow, endRow, playerView.pixels, playerView.pitch, viewPixels, viewPitch);
+        });
+
+        if (SDL_MUSTLOCK(viewLayer)) SDL_UnlockSurface(viewLayer);
+    }
+
+    if (SDL_MUSTLOCK(target)) SDL_UnlockSurface(target);
+
+}
+
+// Draws the next frame, redoing only what changed since the buffer it goes into was last drawn,
+// and presents only what changed since the last frame. Returns false when nothing changed at all,
+// then nothing is drawn or presented.
+bool Update()
+{
+    if (viewLayer == NULL || hudLayer == NULL) return false;
+
+    bool projected;
+    bool viewDirty = viewChanged(projected) || fullRedraw;
+    if (viewDirty) viewVersion++;
+
+    {
+        ScopedTimer timer(STAGE_UI);
+
+        renderUI();
+    }
+
+    FrameContents contents;
+    contents.view = viewVersion;
+    contents.hud = hudVersion;
+    contents.gun = gunTexture;
+    contents.gunRect = gunRect();
+    contents.overlay = showProfiler;
+
+    SDL_Rect windowRects[maxFrameChanges];
+    int windowRectCount = frameChanges(fullRedraw ? FrameContents() : windowContents, contents, windowRects);
+    if (windowRectCount == 0) return false;
+
+    if (viewDirty) drawView(projected);
+
+    {
+        ScopedTimer timer(STAGE_PRESENT);
+
+        frameSurface = presentChain.acquire();
+    }
+
+    {
+        ScopedTimer timer(STAGE_UI);
+
+        // Bring the buffer up to date from the layers, then draw the gun over whatever part of the view was replaced
+        FrameContents& held = bufferContents[frameSurface];
+        SDL_Rect rects[maxFrameChanges];
+        int rectCount = frameChanges(fullRedraw ? FrameContents() : held, contents, rects);
+        bool gunCovered = false;
+        for (int i = 0; i < rectCount; i++)
+        {
+            if (rects[i].y < viewHeight)
+            {
+                copyPixels(viewLayer, rects[i].x, rects[i].y, frameSurface, rects[i]);
+                gunCovered = true;
+            }
+            else copyPixels(hudLayer, rects[i].x, rects[i].y - viewHeight, frameSurface, rects[i]);
+        }
+
+        if (gunCovered)
+        {
+            SDL_Rect gunPosition = { screenWidth / 2 - (192/2) + gunOffsetX, viewHeight - 180 + gunOffsetY, 0, 0 };
+            SDL_Rect viewRect = { 0, 0, screenWidth, viewHeight };
+            SDL_SetClipRect(frameSurface, &viewRect);
+            SDL_BlitSurface(gunTextures[gunTexture], NULL, frameSurface, &gunPosition);
+            SDL_SetClipRect(frameSurface, NULL);
+        }
+        if (showProfiler) renderProfilerOverlay();
+
+        held = contents;
+    }
+
+    {
+        ScopedTimer timer(STAGE_PRESENT);
+
+        presentChain.submit(windowRects, windowRectCount);
+        windowContents = contents;
+    }
+    return true;
+}
+
+// Direction is 1 to move forward and -1 to move backward. Checks a little ahead of the player for walls
+void movePlayer(GameState& state, double direction, double deltaTime)
+{
+    if (worldMap.cell(int(state.posX + direction * state.dirX * moveSpeed*4 * deltaTime), int(state.posY)) == 0) state.posX += direction * state.dirX * moveSpeed * deltaTime;
+    if (worldMap.cell(int(state.posX), int(state.posY + direction * state.dirY * moveSpeed*4 * deltaTime)) == 0) state.posY += direction * state.dirY * moveSpeed * deltaTime;
+}
+
+// Rotates the view direction and camera plane, positive angles turn left
+void rotatePlayer(GameState& state, double angle)
+{
+    double oldDirX = state.dirX;
+    double oldPlaneX = state.planeX;
+
+    state.dirX = state.dirX * cos(angle) - state.dirY * sin(angle);
+    state.dirY = oldDirX * sin(angle) + state.dirY * cos(angle);
+    state.planeX = state.planeX * cos(angle) - state.planeY * sin(angle);
+    state.planeY = oldPlaneX * sin(angle) + state.planeY * cos(angle);
+}
+
+// Entity movement. Each axis moves on its own and a wall turns that axis of the velocity
+// around, the way the player collides but bouncing instead of stopping.
+void updateEntitiesScalar(EntityStore& store, int begin, int end, double deltaTime)
+{
+    for (int i = begin; i < end; i++)
+    {
+        double nextX = store.x[i] + store.velocityX[i] * deltaTime;
+        if (worldMap.cell((int)std::floor(nextX), (int)std::floor(store.y[i])) != 0) store.velocityX[i] = -store.velocityX[i];
+        else store.x[i] = nextX;
+
+        double nextY = store.y[i] + store.velocityY[i] * deltaTime;
+        if (worldMap.cell((int)std::floor(store.x[i]), (int)std::floor(nextY)) != 0) store.velocityY[i] = -store.velocityY[i];
+        else store.y[i] = nextY;
+    }
+}
+
+#ifdef RAYCAST_SIMD
+// All ones in the lanes whose cell is a wall or outside the map, same as TileMap::cell() != 0
+TARGET_AVX2 inline __m128i wallMaskAVX2(__m256d positionX, __m256d positionY)
+{
+    __m128i cellX = _mm256_cvttpd_epi32(_mm256_floor_pd(positionX));
+    __m128i cellY = _mm256_cvttpd_epi32(_mm256_floor_pd(positionY));
+
+    const __m128i minusOne = _mm_set1_epi32(-1);
+    __m128i inside = _mm_and_si128(
+        _mm_and_si128(_mm_cmpgt_epi32(cellX, minusOne), _mm_cmpgt_epi32(_mm_set1_epi32(worldMap.width()), cellX)),
+        _mm_and_si128(_mm_cmpgt_epi32(cellY, minusOne), _mm_cmpgt_epi32(_mm_set1_epi32(worldMap.height()), cellY)));
+
+    // Tiled index, same as TileMap::index()
+    const __m128i tileMask = _mm_set1_epi32(TileMap::tileMask);
+    __m128i tile = _mm_add_epi32(_mm_mullo_epi32(_mm_srli_epi32(cellX, TileMap::tileShift), _mm_set1_epi32(worldMap.tileColumns())), _mm_srli_epi32(cellY, TileMap::tileShift));
+    __m128i index = _mm_or_si128(_mm_slli_epi32(tile, 2 * TileMap::tileShift),
+        _mm_or_si128(_mm_slli_epi32(_mm_and_si128(cellX, tileMask), TileMap::tileShift), _mm_and_si128(cellY, tileMask)));
+
+    // Lanes outside the map keep the 1 they start with
+    __m128i cell = _mm_mask_i32gather_epi32(_mm_set1_epi32(1), (const int*)worldMap.data(), index, inside, 1);
+    cell = _mm_and_si128(cell, _mm_set1_epi32(0xFF));
+    return _mm_cmpgt_epi32(cell, _mm_setzero_si128());
+}
+
+// Four entities at a time with the map cells gathered, the result matches updateEntitiesScalar()
+TARGET_AVX2 void updateEntitiesAVX2(EntityStore& store, int begin, int end, double deltaTime)
+{
+    const __m256d delta = _mm256_set1_pd(deltaTime);
+    const __m256d signBit = _mm256_set1_pd(-0.0);
+
+    int i = begin;
+    for (; i + 4 <= end; i += 4)
+    {
+        __m256d x = _mm256_loadu_pd(&store.x[i]);
+        __m256d y = _mm256_loadu_pd(&store.y[i]);
+        __m256d velocityX = _mm256_loadu_pd(&store.velocityX[i]);
+        __m256d velocityY = _mm256_loadu_pd(&store.velocityY[i]);
+
+        __m256d nextX = _mm256_add_pd(x, _mm256_mul_pd(velocityX, delta));
+        __m256d blockedX = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(wallMaskAVX2(nextX, y)));
+        velocityX = _mm256_blendv_pd(velocityX, _mm256_xor_pd(velocityX, signBit), blockedX);
+        x = _mm256_blendv_pd(nextX, x, blockedX);
+
+        __m256d nextY = _mm256_add_pd(y, _mm256_mul_pd(velocityY, delta));
+        __m256d blockedY = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(wallMaskAVX2(x, nextY)));
+        velocityY = _mm256_blendv_pd(velocityY, _mm256_xor_pd(velocityY, signBit), blockedY);
+        y = _mm256_blendv_pd(nextY, y, blockedY);
+
+        _mm256_storeu_pd(&store.x[i], x);
+        _mm256_storeu_pd(&store.y[i], y);
+        _mm256_storeu_pd(&store.velocityX[i], velocityX);
+        _mm256_storeu_pd(&store.velocityY[i], velocityY);
+    }
+    updateEntitiesScalar(store, i, end, deltaTime);
+}
+#endif
+
+void (*updateEntityRange)(EntityStore& store, int begin, int end, double deltaTime) = updateEntitiesScalar;
+
+// Same preference as selectRayTracer(), "scalar" forces the plain loop
+void selectEntityUpdater(const std::string& preference)
+{
+    updateEntityRange = updateEntitiesScalar;
+#ifdef RAYCAST_SIMD
+    if ((preference == "auto" || preference == "avx2") && SDL_HasAVX2()) updateEntityRange = updateEntitiesAVX2;
+#endif
+}
+
+// Moves every entity one tick and keeps the hitscan grid in step
+void updateEntities(EntityStore& store, double deltaTime)
+{
+    updateEntityRange(store, 0, store.size(), deltaTime);
+
+    for (int i = 0; i < store.size(); i++)
+    {
+        if (store.state[i] == ENTITY_MOVING) spriteGrid.move(i, store.x[i], store.y[i]);
+    }
+}
+
+// One fixed step of game time. Only depends on the state and the input, never on the frame rate.
+void tickGame(GameState& state, const InputState& input)
+{
+    const double deltaTime = simTickDelta;
+
+    for (int i = 0; i < input.shots; i++) shoot(state);
+
+    if (input.forward) movePlayer(state, 1, deltaTime);
+    if (input.backward) movePlayer(state, -1, deltaTime);
+    if (input.turnRight) rotatePlayer(state, -rotSpeed * deltaTime);
+    if (input.turnLeft) rotatePlayer(state, rotSpeed * deltaTime);
+
+    updateEntities(state.entities, deltaTime);
+    updateAwareness(state);
+
+    if (input.forward || input.backward)
+    {
+        if (state.gunSwayRight)
+        {
+            state.gunOffsetX += 300 * deltaTime;
+            if (state.gunOffsetX > 80)
+            {
+                state.gunSwayRight = false;
+            }
+        }
+        else
+        {
+            state.gunOffsetX -= 300 * deltaTime;
+            if (state.gunOffsetX < -80)
+            {
+                state.gunSwayRight = true;
+            }
+        }
+    }
+    else
+    {
+        if (state.gunOffsetX > 0) state.gunOffsetX -= 300 * deltaTime;
+        if (state.gunOffsetX < 0) state.gunOffsetX += 300 * deltaTime;
+    }
+
+    if (!state.canFire) state.fireCooldown -= deltaTime;
+    if (state.fireCooldown <= 0)
+    {
+        state.canFire = true;
+        state.gunTexture = 0;
+        state.fireCooldown = 0.5f;
+    }
+
+    state.tick++;
+}
+
+// The loaded level and the player as they are now, the start of a simulation
+GameState captureGameState()
+{
+    GameState state;
+    state.posX = posX; state.posY = posY;
+    state.dirX = dirX; state.dirY = dirY;
+    state.planeX = planeX; state.planeY = planeY;
+    state.gunOffsetX = gunOffsetX;
+    state.gunOffsetY = gunOffsetY;
+    state.gunTexture = gunTexture;
+    state.faceTexture = faceTexture;
+    state.ammo = ammo;
+    state.health = health;
+    state.entities = entities;
+    return state;
+}
+
+inline double lerp(double a, double b, double t)
+{
+    if (a == b) return a; // A value that didn't change stays put, so a still camera doesn't get redrawn
+    return a * (1 - t) + b * t; // Exact at both ends
+}
+
+// Sets what the renderer draws to a point between two ticks, alpha 0 is previous and 1 is next.
+// The view turns by the angle between the two directions so the field of view never shrinks.
+void applyGameState(const GameState& previous, const GameState& next, double alpha)
+{
+    const GameState& nearest = alpha < 0.5 ? previous : next;
+
+    posX = lerp(previous.posX, next.posX, alpha);
+    posY = lerp(previous.posY, next.posY, alpha);
+    if (alpha <= 0 || alpha >= 1)
+    {
+        dirX = nearest.dirX; dirY = nearest.dirY;
+        planeX = nearest.planeX; planeY = nearest.planeY;
+    }
+    else
+    {
+        double angle = alpha * atan2(previous.dirX * next.dirY - previous.dirY * next.dirX, previous.dirX * next.dirX + previous.dirY * next.dirY);
+        dirX = previous.dirX * cos(angle) - previous.dirY * sin(angle);
+        dirY = previous.dirX * sin(angle) + previous.dirY * cos(angle);
+        planeX = previous.planeX * cos(angle) - previous.planeY * sin(angle);
+        planeY = previous.planeX * sin(angle) + previous.planeY * cos(angle);
+    }
+
+    gunOffsetX = (int)lerp(previous.gunOffsetX, next.gunOffsetX, alpha);
+    gunOffsetY = (int)lerp(previous.gunOffsetY, next.gunOffsetY, alpha);
+    gunTexture = next.gunTexture;
+    faceTexture = next.faceTexture;
+    ammo = next.ammo;
+    health = next.health;
+
+    entities = next.entities;
+    if (alpha < 1 && previous.entities.size() == next.entities.size())
+    {
+        const double* previousX = previous.entities.x.data();
+        const double* previousY = previous.entities.y.data();
+        const double* nextX = next.entities.x.data();
+        const double* nextY = next.entities.y.data();
+        double* x = entities.x.data();
+        double* y = entities.y.data();
+        for (int i = 0; i < entities.size(); i++)
+        {
+            x[i] = lerp(previousX[i], nextX[i], alpha);
+            y[i] = lerp(previousY[i], nextY[i], alpha);
+        }
+    }
+}
+
+// Runs the game in fixed ticks on a schedule kept with the performance counter, either on its
+// own thread or from the main loop through advance(). The last two ticks are kept as snapshots
+// the renderer copies out and interpolates between, so rendering never waits for a tick and
+// ticks never wait for a frame.
+class Simulation
+{
+public:
+    ~Simulation() { stop(); }
+
+    void reset(const GameState& initial)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        state = initial;
+        previous = initial;
+        latest = initial;
+        spriteGrid.build(state.entities, worldMap.width(), worldMap.height());
+        tickLength = std::max<Uint64>(1, clockFrequency() / simTickRate);
+        nextTickTime = now() + tickLength;
+    }
+
+    // Record and replay run the ticks on a clock the main loop sets from the frame times, so a
+    // replay sees the same ticks at the same points between frames. Call before reset().
+    void useManualClock(Uint64 frequency)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        manualFrequency = frequency;
+        manualTime = 0;
+    }
 
-SDL_Window* window = NULL;
-SDL_Surface* screenSurface = NULL;
+    void setTime(Uint64 time)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        manualTime = time;
+    }
 
-// Player variables
-double posX = 2, posY = 2;
-double dirX = -1, dirY = 0;
-double planeX = 0, planeY = 0.66;
-double moveSpeed = 1.8f;
-double rotSpeed = 0.8f;
+    void start()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = false;
+        if (!ticker.joinable()) ticker = std::thread(&Simulation::tickerLoop, this);
+    }
 
-const int wallTextureSize = 64;
-const int wallTypes = 10; // Must always be 1 higher than the actual amount of tile textures, as air (0) counts as a wall type
-SDL_Surface* wallTextures[wallTypes];
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (ticker.joinable()) ticker.join();
+    }
 
-struct Sprite
-{
-    double x;
-    double y;
-    SDL_Surface* texture;
+    bool threaded() const { return ticker.joinable(); }
+
+    // Held controls replace the last ones, shots add up until a tick takes them
+    void setInput(const InputState& controls)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        int shots = input.shots + controls.shots;
+        input = controls;
+        input.shots = shots;
+    }
+
+    // Runs every tick that is due. Without a thread the main loop calls this once a frame.
+    void advance()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        advanceLocked(lock);
+    }
+
+    // Copies out the last two ticks and returns how far the clock is between them
+    double snapshot(GameState& before, GameState& after)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        before = previous;
+        after = latest;
+
+        Uint64 time = now();
+        Uint64 latestTime = nextTickTime - tickLength;
+        if (time <= latestTime) return 0;
+        return std::min(1.0, (time - latestTime) / (double)tickLength);
+    }
+
+private:
+    Uint64 now() const { return manualFrequency ? manualTime : SDL_GetPerformanceCounter(); }
+    Uint64 clockFrequency() const { return manualFrequency ? manualFrequency : SDL_GetPerformanceFrequency(); }
+
+    void advanceLocked(std::unique_lock<std::mutex>& lock)
+    {
+        Uint64 time = now();
+        int ticks = 0;
+        while (nextTickTime <= time && ticks < maxTicksPerFrame)
+        {
+            InputState controls = input;
+            input.shots = 0;
+
+            // The tick itself runs unlocked, only the simulation touches state
+            lock.unlock();
+            tickGame(state, controls);
+            lock.lock();
+
+            std::swap(previous, latest);
+            latest = state;
+            nextTickTime += tickLength;
+            ticks++;
+        }
+        if (nextTickTime <= time) nextTickTime = time + tickLength; // Too far behind, drop the time
+    }
+
+    void tickerLoop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping)
+        {
+            advanceLocked(lock);
+
+            Uint64 time = now();
+            if (nextTickTime > time)
+            {
+                double waitMs = (nextTickTime - time) * 1000.0 / clockFrequency();
+                wake.wait_for(lock, std::chrono::microseconds((Sint64)(waitMs * 1000)), [this] { return stopping; });
+            }
+        }
+    }
+
+    GameState state; // Only touched by whoever runs the ticks
+    GameState previous;
+    GameState latest;
+    InputState input;
+
+    Uint64 tickLength = 1;
+    Uint64 nextTickTime = 0;
+    Uint64 manualFrequency = 0; // 0 runs on the performance counter
+    Uint64 manualTime = 0;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::thread ticker;
+    bool stopping = false;
 };
 
-int numSprites = 1;
-int spriteTypes = 8;
+Simulation simulation;
 
-Sprite sprite[255];
-SDL_Surface* spriteTextures[255];
+void resetPlayer()
+{
+    posX = 2; posY = 2;
+    dirX = -1; dirY = 0;
+    planeX = 0; planeY = 0.66;
+}
 
-double ZBuffer[screenWidth];
+// Open cells whose area is closed off by walls, so every ray cast from them hits something.
+// DDA rays only step between edge neighbours, so a 4-connected flood fill is enough.
+std::vector<int> enclosedOpenCells()
+{
+    int mapWidth = worldMap.width();
+    int mapHeight = worldMap.height();
 
-int spriteOrder[255];
-double spriteDistance[255];
+    std::vector<int> cells;
+    std::vector<bool> visited(mapWidth * mapHeight, false);
+    std::vector<int> region;
+    std::vector<int> stack;
 
-// HUD
-SDL_Surface* uibg;
+    for (int start = 0; start < mapWidth * mapHeight; start++)
+    {
+        if (visited[start] || worldMap.at(start / mapHeight, start % mapHeight) != 0) continue;
 
-int numGuns = 1;
-SDL_Surface* gunTextures[255];
-int gunTexture = 0;
+        region.clear();
+        stack.push_back(start);
+        visited[start] = true;
+        bool touchesEdge = false;
 
-int gunOffsetX = 0;
-int gunOffsetY = 0;
-bool gunSwayRight = true;
+        while (!stack.empty())
+        {
+            int cell = stack.back();
+            stack.pop_back();
+            region.push_back(cell);
 
-bool canFire = true;
-double fireCooldown = 1.0;
+            int x = cell / mapHeight;
+            int y = cell % mapHeight;
+            if (x == 0 || y == 0 || x == mapWidth - 1 || y == mapHeight - 1)
+            {
+                touchesEdge = true;
+                continue;
+            }
 
-int numFaces = 1;
-SDL_Surface* faceTextures[255];
-int faceTexture = 0;
+            const int neighbours[4] = { cell - mapHeight, cell + mapHeight, cell - 1, cell + 1 };
+            for (int next : neighbours)
+            {
+                if (visited[next] || worldMap.at(next / mapHeight, next % mapHeight) != 0) continue;
+                visited[next] = true;
+                stack.push_back(next);
+            }
+        }
 
-TTF_Font* font = NULL;
+        if (!touchesEdge) cells.insert(cells.end(), region.begin(), region.end());
+    }
 
-// AUDIO
-Mix_Music* music = NULL;
-Mix_Chunk* fire = NULL;
+    std::sort(cells.begin(), cells.end());
+    return cells;
+}
+
+// Adds moving entities on random open cells, the same ones on every run
+void spawnEntities(int count, const std::vector<int>& openCells, Uint32 seed)
+{
+    if (openCells.empty()) return;
+
+    std::mt19937 random(seed);
+    const double toUnit = 1.0 / 4294967296.0;
+    for (int i = 0; i < count; i++)
+    {
+        int cell = openCells[random() % openCells.size()];
+        double angle = random() * toUnit * 2 * 3.14159265358979;
+        double speed = 0.2 + random() * toUnit * 0.6;
+
+        int index = entities.add(cell / worldMap.height() + 0.5, cell % worldMap.height() + 0.5, 1 + random() % (spriteTypes - 1));
+        entities.velocityX[index] = cos(angle) * speed;
+        entities.velocityY[index] = sin(angle) * speed;
+        entities.state[index] = ENTITY_MOVING;
+    }
+}
+
+// Headless benchmark, renders a fixed camera path through every map with the dummy video driver.
+// With entityCount each map also gets that many moving sprites, updated every frame.
+int runBenchmark(int frames, int entityCount)
+{
+    SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+    if (SDL_Init(SDL_INIT_VIDEO) < 0)
+    {
+        printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
+        return 1;
+    }
+
+    window = SDL_CreateWindow("Benchmark", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, screenWidth, screenHeight, 0);
+    if (window == NULL)
+    {
+        printf("Window could not be created! SDL_Error: %s\n", SDL_GetError());
+        SDL_Quit();
+        return 1;
+    }
+    screenSurface = SDL_GetWindowSurface(window);
+    createRenderTarget();
+    createLayers();
+    presentChain.start(presentBuffers);
+
+    assets.start();
+    preloadMapTextures();
+    loadMedia();
+
+    const char* maps[] = { "maps/0.rmap", "maps/1.rmap", "maps/2.rmap" };
+    const int mapCount = 3;
+    const double benchDeltaTime = 3.0 / 60.0; // Same units as simTickDelta, 60 frames per second
+
+    std::vector<double> frameTimes;
+    frameTimes.reserve(frames);
+    double stageTotals[STAGE_COUNT] = {};
+
+    for (int m = 0; m < mapCount; m++)
+    {
+        if (!loadMap(maps[m])) continue;
+        resetPlayer();
+
+        // The path stops at open cells spread over the whole map and turns a full circle at each
+        std::vector<int> openCells = enclosedOpenCells();
+
+        spawnEntities(entityCount, openCells, m + 1);
+        GameState state = captureGameState();
+        spriteGrid.build(state.entities, worldMap.width(), worldMap.height());
+
+        const int stops = 6;
+        int mapFrames = frames / mapCount + (m < frames % mapCount ? 1 : 0);
+        int framesPerStop = std::max(1, (mapFrames + stops - 1) / stops);
+
+        for (int f = 0; f < mapFrames; f++)
+        {
+            if (f % framesPerStop == 0 && !openCells.empty())
+            {
+                int cell = openCells[(f / framesPerStop) * openCells.size() / stops % openCells.size()];
+                state.posX = cell / worldMap.height() + 0.5;
+                state.posY = cell % worldMap.height() + 0.5;
+            }
+            rotatePlayer(state, 2 * 3.14159265358979 / framesPerStop);
+
+            beginFrame();
+            {
+                ScopedTimer timer(STAGE_SIMULATE);
+
+                updateEntities(state.entities, benchDeltaTime);
+                applyGameState(state, state, 1);
+            }
+            Update();
+            endFrame();
+            if (resolutionController.enabled()) setRenderScale(resolutionController.update(currentFrame.frameMs, renderScale));
+
+            frameTimes.push_back(currentFrame.frameMs);
+            for (int s = 0; s < STAGE_COUNT; s++) stageTotals[s] += currentFrame.stageMs[s];
+        }
+    }
+
+    // Frame times only count until a frame is handed over, the last ones are still being presented
+    presentChain.stop();
+
+    double totalTime = 0;
+    for (double time : frameTimes) totalTime += time;
+
+    std::vector<double> sorted = frameTimes;
+    std::sort(sorted.begin(), sorted.end());
+    int count = (int)sorted.size();
+
+    printf("Benchmark: %d frames at %dx%d, %d thread(s), %s DDA, %d present buffer(s)\n", count, screenWidth, viewHeight, renderPool.threadCount(), rayTracerName(), presentBuffers);
+    if (entityCount > 0) printf("  %d moving entities per map\n", entityCount);
+    if (renderTarget) printf("  rendered at %dx%d, scale %.2f\n", renderWidth, renderHeight, renderScale);
+    if (count > 0)
+    {
+        printf("  frames/sec   %10.1f\n", count * 1000.0 / totalTime);
+        printf("  frame p50    %10.3f ms\n", sorted[(count - 1) / 2]);
+        printf("  frame p99    %10.3f ms\n", sorted[(int)((count - 1) * 0.99)]);
+        double renderTotal = 0;
+        for (int s = STAGE_WALL_CAST; s <= STAGE_PRESENT; s++)
+        {
+            printf("  %-12s %10.3f ms\n", stageNames[s], stageTotals[s] / count);
+            renderTotal += stageTotals[s];
+        }
+        printf("  %-12s %10.3f ms\n", stageNames[STAGE_SIMULATE], stageTotals[STAGE_SIMULATE] / count);
+        printf("  update %.3f ms, render %.3f ms per frame\n", stageTotals[STAGE_SIMULATE] / count, renderTotal / count);
+    }
+
+    writeProfile();
+
+    assets.stop();
+    renderPool.stop();
+    freeRenderSurfaces();
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+
+    return 0;
+}
 
-void sortSprites(int* order, double* dist, int amount)
+// Headless benchmark of many small views at once, like bots checking what they can see or a wall
+// of security camera monitors. Each map gets viewCount cameras spread over its open cells, drawn
+// one after another on this thread and then together with renderViews(), which has to give the
+// same pixels.
+int runViewBenchmark(int viewCount, int width, int height, int entityCount)
 {
-    std::vector<std::pair<double, int>> sprites(amount);
-    for (int i = 0; i < amount; i++) {
-        sprites[i].first = dist[i];
-        sprites[i].second = order[i];
+    SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+    if (SDL_Init(SDL_INIT_VIDEO) < 0)
+    {
+        printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
+        return 1;
+    }
+
+    window = SDL_CreateWindow("Benchmark", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, screenWidth, screenHeight, 0);
+    if (window == NULL)
+    {
+        printf("Window could not be created! SDL_Error: %s\n", SDL_GetError());
+        SDL_Quit();
+        return 1;
+    }
+    screenSurface = SDL_GetWindowSurface(window);
+
+    assets.start();
+    preloadMapTextures();
+
+    const char* maps[] = { "maps/0.rmap", "maps/1.rmap", "maps/2.rmap" };
+    const int mapCount = 3;
+    const int rounds = 20;
+
+    // Every view gets its own pixels, once for the serial pass and once for the batch
+    size_t viewPixels = (size_t)width * height;
+    std::vector<Uint32> serialPixels(viewPixels * viewCount);
+    std::vector<Uint32> batchPixels(viewPixels * viewCount);
+    std::vector<Framebuffer> serialViews(viewCount);
+    std::vector<Framebuffer> batchViews(viewCount);
+    for (int i = 0; i < viewCount; i++)
+    {
+        serialViews[i].attach(serialPixels.data() + i * viewPixels, width, height, width, screenSurface->format);
+        batchViews[i].attach(batchPixels.data() + i * viewPixels, width, height, width, screenSurface->format);
+    }
+    std::vector<Camera> cameras(viewCount);
+
+    double serialMs = 0, batchMs = 0;
+    int views = 0;
+    int mismatchedMaps = 0;
+
+    for (int m = 0; m < mapCount; m++)
+    {
+        if (!loadMap(maps[m])) continue;
+        std::vector<int> openCells = enclosedOpenCells();
+        if (openCells.empty()) continue;
+        spawnEntities(entityCount, openCells, m + 1);
+
+        for (int i = 0; i < viewCount; i++)
+        {
+            int cell = openCells[(size_t)i * openCells.size() / viewCount];
+            double angle = i * 2.39996322972865; // Golden angle, so neighbouring views look different ways
+            Camera& camera = cameras[i];
+            camera.posX = cell / worldMap.height() + 0.5;
+            camera.posY = cell % worldMap.height() + 0.5;
+            camera.dirX = cos(angle);
+            camera.dirY = sin(angle);
+            camera.planeX = camera.dirY * 0.66;
+            camera.planeY = -camera.dirX * 0.66;
+        }
+
+        World world = { worldMap, entities, visibilitySets, lightMap };
+        for (int r = 0; r < rounds; r++)
+        {
+            Uint64 start = SDL_GetPerformanceCounter();
+            for (int i = 0; i < viewCount; i++) render(cameras[i], world, serialViews[i]);
+            serialMs += millisecondsSince(start);
+
+            start = SDL_GetPerformanceCounter();
+            renderViews(cameras.data(), batchViews.data(), viewCount, world);
+            batchMs += millisecondsSince(start);
+        }
+        views += rounds * viewCount;
+
+        if (serialPixels != batchPixels) mismatchedMaps++;
     }
-    std::sort(sprites.begin(), sprites.end());
-    // restore in reverse order to go from farthest to nearest
-    for (int i = 0; i < amount; i++) {
-        dist[i] = sprites[amount - i - 1].first;
-        order[i] = sprites[amount - i - 1].second;
+
+    printf("View benchmark: %d views of %dx%d per map, %d rounds, %d thread(s), %s DDA\n", viewCount, width, height, rounds, renderPool.threadCount(), rayTracerName());
+    if (entityCount > 0) printf("  %d entities per map\n", entityCount);
+    if (views > 0 && serialMs > 0 && batchMs > 0)
+    {
+        printf("  serial       %10.1f views/sec\n", views * 1000.0 / serialMs);
+        printf("  batch        %10.1f views/sec\n", views * 1000.0 / batchMs);
+        printf("  batch speedup %.2fx\n", serialMs / batchMs);
     }
+    if (mismatchedMaps > 0) printf("  batch views differ from the serial ones on %d map(s)\n", mismatchedMaps);
+
+    assets.stop();
+    renderPool.stop();
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+
+    return mismatchedMaps > 0 ? 1 : 0;
 }
 
-void loadMap(const std::string& filename) {
-    // Load wall textures
-    for (int i = 1; i < wallTypes; i++) {
-        std::string fileName = "walls/tile_" + std::to_string(i) + ".bmp";
-        wallTextures[i] = SDL_LoadBMP(fileName.c_str());
-        if (!wallTextures[i]) {
-            std::cerr << "Failed to load wall texture! SDL_Error: " << SDL_GetError() << std::endl;
+// Fills a map with walls at random, a solid border around it so every ray ends
+void randomMap(TileMap& map, int width, int height, int wallPercent, std::mt19937& random)
+{
+    map.resize(width, height);
+    for (int x = 0; x < width; x++)
+    {
+        for (int y = 0; y < height; y++)
+        {
+            bool border = x == 0 || y == 0 || x == width - 1 || y == height - 1;
+            map.set(x, y, border || (int)(random() % 100) < wallPercent ? 1 + random() % (wallTypes - 1) : 0);
         }
     }
-    // Load sprite textures
-    for (int i = 1; i <= spriteTypes; i++) {
-        std::string fileName = "sprites/sprite_" + std::to_string(i) + ".bmp";
-        spriteTextures[i] = SDL_LoadBMP(fileName.c_str());
-        if (!spriteTextures[i]) {
-            std::cerr << "Failed to load sprite texture! SDL_Error: " << SDL_GetError() << std::endl;
+    map.rebuildEmptyRadius();
+}
+
+// Hitscan the slow way, every sprite against the first wall the ray reaches
+HitscanResult bruteForceHitscan(const EntityStore& sprites, const HitscanRay& ray)
+{
+    HitscanResult result;
+
+    double length = std::sqrt(ray.dirX * ray.dirX + ray.dirY * ray.dirY);
+    double dirX = ray.dirX / length;
+    double dirY = ray.dirY / length;
+
+    int mapX = (int)std::floor(ray.x);
+    int mapY = (int)std::floor(ray.y);
+    double deltaDistX = dirX == 0 ? 1e30 : std::fabs(1 / dirX);
+    double deltaDistY = dirY == 0 ? 1e30 : std::fabs(1 / dirY);
+    double sideDistX = (dirX < 0 ? ray.x - mapX : mapX + 1.0 - ray.x) * deltaDistX;
+    double sideDistY = (dirY < 0 ? ray.y - mapY : mapY + 1.0 - ray.y) * deltaDistY;
+    double wallDistance = 0;
+    while (worldMap.cell(mapX, mapY) == 0)
+    {
+        if (sideDistX < sideDistY)
+        {
+            wallDistance = sideDistX;
+            sideDistX += deltaDistX;
+            mapX += dirX < 0 ? -1 : 1;
         }
+        else
+        {
+            wallDistance = sideDistY;
+            sideDistY += deltaDistY;
+            mapY += dirY < 0 ? -1 : 1;
+        }
+    }
+    if (wallDistance <= ray.range)
+    {
+        result.kind = HIT_WALL;
+        result.distance = wallDistance;
+        result.cellX = mapX;
+        result.cellY = mapY;
     }
 
-    std::ifstream file(filename);
-    if (!file.is_open()) {
-        std::cerr << "Could not open file for reading.\n";
-        return;
+    for (int i = 0; i < sprites.size(); i++)
+    {
+        double distance = raySpriteDistance(ray, dirX, dirY, sprites.x[i], sprites.y[i]);
+        if (distance < 0 || distance > ray.range) continue;
+        if (result.kind == HIT_NONE || distance < result.distance || (result.kind == HIT_WALL && distance == result.distance))
+        {
+            result.kind = HIT_SPRITE;
+            result.distance = distance;
+            result.sprite = i;
+        }
     }
+    return result;
+}
 
-    std::string line;
-    // Skip to the line containing the map data
-    while (std::getline(file, line)) {
-        if (line.find("int worldMap") != std::string::npos) {
+// The sprite grid walk against the brute force scan, with some sprites moved after the build
+int testHitscan(std::mt19937& random)
+{
+    const double toUnit = 1.0 / 4294967296.0;
+    const int spriteCount = 300;
+    const int rayCount = 200000;
+
+    randomMap(worldMap, 48, 40, 20, random);
+    std::vector<int> openCells;
+    for (int x = 0; x < worldMap.width(); x++)
+        for (int y = 0; y < worldMap.height(); y++)
+            if (worldMap.at(x, y) == 0) openCells.push_back(x * worldMap.height() + y);
+
+    auto randomOpenPoint = [&](double& x, double& y)
+    {
+        int cell = openCells[random() % openCells.size()];
+        x = cell / worldMap.height() + random() * toUnit;
+        y = cell % worldMap.height() + random() * toUnit;
+    };
+
+    EntityStore sprites;
+    for (int i = 0; i < spriteCount; i++)
+    {
+        double x, y;
+        randomOpenPoint(x, y);
+        sprites.add(x, y, 1);
+    }
+    spriteGrid.build(sprites, worldMap.width(), worldMap.height());
+    for (int i = 0; i < spriteCount; i += 3)
+    {
+        randomOpenPoint(sprites.x[i], sprites.y[i]);
+        spriteGrid.move(i, sprites.x[i], sprites.y[i]);
+    }
+
+    int failures = 0;
+    for (int i = 0; i < rayCount; i++)
+    {
+        HitscanRay ray;
+        randomOpenPoint(ray.x, ray.y);
+        double angle = random() * toUnit * 2 * 3.14159265358979;
+        ray.dirX = cos(angle);
+        ray.dirY = sin(angle);
+        if (i % 4 == 0) ray.range = random() * toUnit * 20;
+
+        HitscanResult fast = traceHitscan(sprites, ray);
+        HitscanResult slow = bruteForceHitscan(sprites, ray);
+        // Two sprites entered at the same distance may come back either way
+        bool same = fast.kind == slow.kind && std::fabs(fast.distance - slow.distance) < 1e-9
+            && (fast.kind != HIT_WALL || (fast.cellX == slow.cellX && fast.cellY == slow.cellY))
+            && (fast.kind != HIT_SPRITE || fast.sprite == slow.sprite || fast.distance == slow.distance);
+        if (!same && failures++ < 5)
+        {
+            printf("  hitscan from %.3f,%.3f dir %.3f,%.3f: grid %d at %.6f (sprite %d), brute force %d at %.6f (sprite %d)\n",
+                ray.x, ray.y, ray.dirX, ray.dirY, fast.kind, fast.distance, fast.sprite, slow.kind, slow.distance, slow.sprite);
+        }
+    }
+    printf("  hitscan: %d rays, %d sprites, %d mismatch(es)\n", rayCount, spriteCount, failures);
+    return failures;
+}
+
+// Sets kept up to date cell by cell against sets built from scratch, with walls going up and
+// coming down at random
+int testVisibilityUpdates(std::mt19937& random)
+{
+    int failures = 0;
+    int edits = 0;
+    for (int trial = 0; trial < 30; trial++)
+    {
+        TileMap map;
+        randomMap(map, 6 + random() % 24, 6 + random() % 24, random() % 40, random);
+        VisibilitySets sets;
+        sets.build(map);
+
+        for (int e = 0; e < 30; e++, edits++)
+        {
+            int x = random() % map.width();
+            int y = random() % map.height();
+            map.set(x, y, map.at(x, y) != 0 ? 0 : 1 + random() % (wallTypes - 1));
+            sets.update(map, x, y);
+
+            VisibilitySets built;
+            built.build(map);
+            bool same = true;
+            for (int cx = 0; cx < map.width() && same; cx++)
+                for (int cy = 0; cy < map.height() && same; cy++)
+                    same = memcmp(sets.row(cx, cy), built.row(cx, cy), sets.wordsPerRow() * sizeof(Uint64)) == 0;
+            if (!same && failures++ < 5) printf("  visibility sets differ from a rebuild after changing %d,%d on a %dx%d map\n", x, y, map.width(), map.height());
+        }
+    }
+    printf("  visibility updates: %d edits, %d mismatch(es)\n", edits, failures);
+    return failures;
+}
+
+// Sight checks the sets answer against rays traced for every query
+int testSightChecks(std::mt19937& random)
+{
+    const double toUnit = 1.0 / 4294967296.0;
+    const int queryCount = 500;
+
+    int failures = 0;
+    int traced = 0, asked = 0;
+    std::vector<SightQuery> queries(queryCount);
+    std::vector<Uint8> results(queryCount);
+    for (int trial = 0; trial < 200; trial++)
+    {
+        TileMap map;
+        randomMap(map, 6 + random() % 30, 6 + random() % 30, 30, random);
+        VisibilitySets sets;
+        sets.build(map);
+
+        for (SightQuery& query : queries)
+        {
+            query.fromX = random() * toUnit * map.width();
+            query.fromY = random() * toUnit * map.height();
+            query.toX = random() * toUnit * map.width();
+            query.toY = random() * toUnit * map.height();
+        }
+        traced += checkSight(map, sets, queries.data(), results.data(), queryCount);
+        asked += queryCount;
+        for (int i = 0; i < queryCount; i++)
+        {
+            if (results[i] == (Uint8)traceSight(map, queries[i])) continue;
+            if (failures++ < 5) printf("  sight from %.3f,%.3f to %.3f,%.3f: sets say %d\n", queries[i].fromX, queries[i].fromY, queries[i].toX, queries[i].toY, results[i]);
+        }
+    }
+    printf("  sight checks: %d queries, %d traced, %d mismatch(es)\n", asked, traced, failures);
+    return failures;
+}
+
+// The loaded map edited through setMapCell(), its visibility sets and lightmap against ones
+// built from scratch, with walls going up and coming down between random lights
+int testLightUpdates(std::mt19937& random)
+{
+    int failures = 0;
+    int edits = 0;
+    for (int trial = 0; trial < 100; trial++)
+    {
+        randomMap(worldMap, 6 + random() % 28, 6 + random() % 28, 25, random);
+        visibilitySets.build(worldMap);
+
+        MapLighting lighting;
+        lighting.ambient = (Uint8)(random() % 200);
+        int lightCount = random() % 6;
+        for (int i = 0; i < lightCount; i++)
+        {
+            MapLight light = { (float)(random() % worldMap.width()) + 0.5f, (float)(random() % worldMap.height()) + 0.5f, (float)(1 + random() % 10), 0.5f + (random() % 10) / 10.0f };
+            lighting.lights.push_back(light);
+        }
+        lightMap.build(worldMap, visibilitySets, lighting);
+
+        for (int e = 0; e < 20; e++, edits++)
+        {
+            int x = random() % worldMap.width();
+            int y = random() % worldMap.height();
+            setMapCell(x, y, worldMap.at(x, y) != 0 ? 0 : 1 + random() % (wallTypes - 1));
+
+            VisibilitySets built;
+            built.build(worldMap);
+            LightMap baked;
+            baked.build(worldMap, built, lighting);
+            bool same = true;
+            for (int cx = 0; cx < worldMap.width() && same; cx++)
+            {
+                for (int cy = 0; cy < worldMap.height() && same; cy++)
+                {
+                    same = memcmp(visibilitySets.row(cx, cy), built.row(cx, cy), built.wordsPerRow() * sizeof(Uint64)) == 0;
+                    if (same && worldMap.at(cx, cy) == 0) same = lightMap.cellShade(cx, cy) == baked.cellShade(cx, cy);
+                    for (int face = 0; face < 4 && same; face++) same = lightMap.faceShade(cx, cy, face) == baked.faceShade(cx, cy, face);
+                }
+            }
+            if (!same && failures++ < 5) printf("  map differs from a rebuild after setting %d,%d on a %dx%d map\n", x, y, worldMap.width(), worldMap.height());
+        }
+    }
+    printf("  setMapCell updates: %d edits, %d mismatch(es)\n", edits, failures);
+    return failures;
+}
+
+// Checks the accelerated queries against plain versions on random maps. Runs headless, without
+// assets, and returns 1 when anything disagrees.
+int runSelfTest()
+{
+    std::mt19937 random(1);
+    int failures = 0;
+    failures += testHitscan(random);
+    failures += testVisibilityUpdates(random);
+    failures += testSightChecks(random);
+    failures += testLightUpdates(random);
+
+    printf(failures > 0 ? "Self test failed\n" : "Self test passed\n");
+    return failures > 0 ? 1 : 0;
+}
+
+// Applies one window event to the held controls, the live loop and replays both go through here
+void handleEvent(const SDL_Event& event, InputState& input, bool& done)
+{
+    if (event.type == SDL_KEYDOWN)
+    {
+        /* Check the SDLKey values and move change the coords */
+        switch (event.key.keysym.sym) {
+        case SDLK_LEFT:
+            input.turnLeft = true;
+            break;
+        case SDLK_RIGHT:
+            input.turnRight = true;
+            break;
+        case SDLK_UP:
+            input.forward = true;
+            break;
+        case SDLK_DOWN:
+            input.backward = true;
+            break;
+        case SDLK_LCTRL:
+            input.shots++;
+            break;
+        case SDLK_F3:
+            showProfiler = !showProfiler;
+            break;
+        case SDLK_ESCAPE:
+            done = true;
+            break;
+        default:
+            break;
+        }
+    }
+    if (event.type == SDL_KEYUP)
+    {
+        /* Check the SDLKey values and move change the coords */
+        switch (event.key.keysym.sym) {
+        case SDLK_LEFT:
+            input.turnLeft = false;
+            break;
+        case SDLK_RIGHT:
+            input.turnRight = false;
+            break;
+        case SDLK_UP:
+            input.forward = false;
+            break;
+        case SDLK_DOWN:
+            input.backward = false;
+            break;
+        default:
             break;
         }
     }
+    if (event.type == SDL_QUIT) done = true;
 
-    for (int y = 0; y < mapHeight; y++) {
-        std::getline(file, line);
-        std::stringstream ss(line);
-        std::string temp;
+    // The window lost what it showed, present the next frame whole
+    if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_EXPOSED) windowContents = FrameContents();
+}
 
-        // Expecting a line starting with a brace
-        std::getline(ss, temp, '{');
-        for (int x = 0; x < mapWidth; x++) {
-            int mapValue;
-            ss >> mapValue;
-            worldMap[y][x] = mapValue;
+// Input recordings. A recording is a text file: the settings that change what gets drawn, then
+// every frame's key events followed by a "frame" line with the frame's length in microseconds
+// and the hash of what it drew. The simulation runs on a clock built from those lengths, so a
+// replay ticks exactly as the recorded run did. The profiler overlay draws live timings, frames
+// with it open won't replay the same.
+const char* recordingMagic = "RAYCAST-RECORDING 1";
+const Uint64 recordingClockRate = 1000000;
 
-            // Read until the next comma or closing brace
-            std::getline(ss, temp, (x < mapWidth - 1) ? ',' : '}');
-        }
-    }
+struct RecordedEvent
+{
+    Uint32 type; // SDL_KEYDOWN, SDL_KEYUP or SDL_QUIT
+    SDL_Keycode key;
+};
 
-    // Skip to the line containing the sprite data
-    while (std::getline(file, line)) {
-        if (line.find("int spriteMap") != std::string::npos) {
-            break;
-        }
-    }
+struct RecordedFrame
+{
+    std::vector<RecordedEvent> events; // Handled before the frame is drawn
+    Uint64 micros = 0;
+    Uint64 hash = 0;
+};
 
-    for (int y = 0; y < mapHeight; y++) {
-        std::getline(file, line);
-        std::stringstream ss(line);
-        std::string temp;
+struct Recording
+{
+    std::string map;
+    int width = 0;
+    int height = 0;
+    double renderScale = 1;
+    int upscale = UPSCALE_BILINEAR;
+    int floorTexture = 0;
+    int ceilingTexture = 0;
+    double maxRayDistance = 1e30;
+    std::vector<RecordedFrame> frames;
+};
 
-        // Expecting a line starting with a brace
-        std::getline(ss, temp, '{');
-        for (int x = 0; x < mapWidth; x++) {          
-            // Read until the next comma or closing brace
-            std::getline(ss, temp, (x < mapWidth - 1) ? ',' : '}');
-            int spriteValue;
-            ss >> spriteValue;
-            if (spriteValue == 0) continue;
-            numSprites++;
+// Copies the visible colour of every pixel, leaving out the pitch padding and the unused byte
+void captureFrame(SDL_Surface* surface, std::vector<Uint32>& pixels)
+{
+    Uint32 colorMask = surface->format->Rmask | surface->format->Gmask | surface->format->Bmask;
+    pixels.resize((size_t)surface->w * surface->h);
 
-            // Apply sprite data
-            sprite[numSprites].y = x + 1.5f;
-            sprite[numSprites].x = y + 0.5f;
-            sprite[numSprites].texture = spriteTextures[spriteValue];
-        }
+    if (SDL_MUSTLOCK(surface)) SDL_LockSurface(surface);
+    for (int y = 0; y < surface->h; y++)
+    {
+        const Uint32* row = (const Uint32*)((const Uint8*)surface->pixels + (size_t)y * surface->pitch);
+        Uint32* destination = pixels.data() + (size_t)y * surface->w;
+        for (int x = 0; x < surface->w; x++) destination[x] = row[x] & colorMask;
     }
-
-    file.close();
-    std::cout << "Loaded Map " << filename << "\n";
+    if (SDL_MUSTLOCK(surface)) SDL_UnlockSurface(surface);
 }
 
-SDL_Color getPixelColor(SDL_Surface* surface, int x, int y) {
-    SDL_Color color = { 0, 0, 0, 255 }; // Default color (black)
-
-    // Check if the surface is valid
-    if (surface == nullptr) {
-        std::cerr << "Surface is null!" << std::endl;
-        return color;
+// FNV-1a, a pixel at a time
+Uint64 hashPixels(const std::vector<Uint32>& pixels)
+{
+    Uint64 hash = 14695981039346656037ULL;
+    for (Uint32 pixel : pixels)
+    {
+        hash ^= pixel;
+        hash *= 1099511628211ULL;
     }
+    return hash;
+}
+
+class InputRecorder
+{
+public:
+    bool open(const std::string& path, const std::string& map)
+    {
+        file.open(path);
+        if (!file.is_open())
+        {
+            printf("Could not open %s for recording\n", path.c_str());
+            return false;
+        }
 
-    // Lock the surface if necessary
-    if (SDL_MUSTLOCK(surface)) {
-        SDL_LockSurface(surface);
+        file.precision(17);
+        file << recordingMagic << "\n";
+        file << "map " << map << "\n";
+        file << "resolution " << screenWidth << " " << viewHeight << "\n";
+        file << "render-scale " << renderScale << "\n";
+        file << "upscale " << (int)upscaleFilter << "\n";
+        file << "surface-textures " << defaultFloorTexture << " " << defaultCeilingTexture << "\n";
+        file << "max-ray-distance " << maxRayDistance << "\n";
+        frames = 0;
+        return true;
     }
 
-    // Calculate the pixel position
-    int bpp = surface->format->BytesPerPixel;
-    Uint8* pixel = (Uint8*)surface->pixels + y * surface->pitch + x * bpp;
+    bool isOpen() const { return file.is_open(); }
+    int frameCount() const { return frames; }
 
-    // Get the color based on the pixel format
-    switch (bpp) {
-    case 1: // 8-bit
-        color.r = color.g = color.b = *pixel; // Grayscale
-        break;
-    case 2: // 16-bit
+    void event(const SDL_Event& event)
     {
-        Uint16 p = *(Uint16*)pixel;
-        SDL_GetRGB(p, surface->format, &color.r, &color.g, &color.b);
-    }
-    break;
-    case 3: // 24-bit
-        color.b = *pixel++;
-        color.g = *pixel++;
-        color.r = *pixel++;
-        break;
-    case 4: // 32-bit
-        Uint32 p = *(Uint32*)pixel;
-        SDL_GetRGBA(p, surface->format, &color.r, &color.g, &color.b, &color.a);
-        break;
+        if (event.type == SDL_KEYDOWN) file << "down " << event.key.keysym.sym << "\n";
+        else if (event.type == SDL_KEYUP) file << "up " << event.key.keysym.sym << "\n";
+        else if (event.type == SDL_QUIT) file << "quit\n";
     }
 
-    // Unlock the surface if it was locked
-    if (SDL_MUSTLOCK(surface)) {
-        SDL_UnlockSurface(surface);
+    void frame(Uint64 micros, Uint64 hash)
+    {
+        char line[64];
+        snprintf(line, sizeof(line), "frame %llu %016llx\n", (unsigned long long)micros, (unsigned long long)hash);
+        file << line;
+        frames++;
     }
 
-    return color;
-}
+    void close() { file.close(); }
+
+private:
+    std::ofstream file;
+    int frames = 0;
+};
+
+InputRecorder recorder;
 
-void setPixel(SDL_Surface* surface, int x, int y, Uint32 color) {
-    // Check if the coordinates are within the surface bounds
-    if (x < 0 || x >= surface->w || y < 0 || y >= surface->h) {
-        return; // Out of bounds
+bool loadRecording(const std::string& path, Recording& recording)
+{
+    std::ifstream file(path);
+    if (!file.is_open())
+    {
+        printf("Could not open recording %s\n", path.c_str());
+        return false;
     }
 
-    // Lock the surface if it is not already locked
-    if (SDL_MUSTLOCK(surface)) {
-        if (SDL_LockSurface(surface) < 0) {
-            std::cerr << "Unable to lock surface: " << SDL_GetError() << std::endl;
-            return;
-        }
+    std::string line;
+    if (!std::getline(file, line) || line != recordingMagic)
+    {
+        printf("%s is not a recording\n", path.c_str());
+        return false;
     }
 
-    // Get the address of the pixel
-    Uint32* pixels = (Uint32*)surface->pixels;
-    pixels[(y * surface->w) + x] = color; // Set the pixel color
+    // Events after the last frame line never reached a drawn frame and are left out
+    RecordedFrame frame;
+    while (std::getline(file, line))
+    {
+        std::istringstream fields(line);
+        std::string key;
+        fields >> key;
+        if (key == "down" || key == "up")
+        {
+            Sint64 sym = 0;
+            fields >> sym;
+            RecordedEvent event = { (Uint32)(key == "down" ? SDL_KEYDOWN : SDL_KEYUP), (SDL_Keycode)sym };
+            frame.events.push_back(event);
+        }
+        else if (key == "quit")
+        {
+            RecordedEvent event = { (Uint32)SDL_QUIT, 0 };
+            frame.events.push_back(event);
+        }
+        else if (key == "frame")
+        {
+            unsigned long long micros = 0;
+            std::string hash;
+            fields >> micros >> hash;
+            frame.micros = micros;
+            frame.hash = strtoull(hash.c_str(), NULL, 16);
+            recording.frames.push_back(frame);
+            frame = RecordedFrame();
+        }
+        else if (key == "map") fields >> recording.map;
+        else if (key == "resolution") fields >> recording.width >> recording.height;
+        else if (key == "render-scale") fields >> recording.renderScale;
+        else if (key == "upscale") fields >> recording.upscale;
+        else if (key == "surface-textures") fields >> recording.floorTexture >> recording.ceilingTexture;
+        else if (key == "max-ray-distance") fields >> recording.maxRayDistance;
+    }
 
-    // Unlock the surface
-    if (SDL_MUSTLOCK(surface)) {
-        SDL_UnlockSurface(surface);
+    if (recording.map.empty() || recording.width < 1 || recording.height < 1 || recording.renderScale < minRenderScale ||
+        recording.floorTexture < 0 || recording.floorTexture >= wallTypes || recording.ceilingTexture < 0 || recording.ceilingTexture >= wallTypes)
+    {
+        printf("%s has invalid settings\n", path.c_str());
+        return false;
     }
+    return true;
 }
 
-void loadMedia()
+// Raw frames written by --save-frames and read back by --compare: "RRFR", width and height,
+// then every frame's captured pixels
+const char frameFileMagic[4] = { 'R', 'R', 'F', 'R' };
+
+// Prints where a frame differs from the reference, returns the number of pixels that differ
+int reportDifference(int frame, const std::vector<Uint32>& expected, const std::vector<Uint32>& actual, int width)
 {
-    std::string nameOfFile = "ui/uibg.bmp";
-    uibg = SDL_LoadBMP(nameOfFile.c_str());
+    int differing = 0;
+    int left = width, top = (int)(actual.size() / width), right = -1, bottom = -1;
+    int largest = 0;
+    size_t first = 0;
+    for (size_t i = 0; i < actual.size(); i++)
+    {
+        if (expected[i] == actual[i]) continue;
+        if (differing++ == 0) first = i;
 
-    // Gun UI
-    for (int i = 0; i < numGuns*2; i++) {
-        std::string fileName = "ui/gun_" + std::to_string(i) + ".bmp";
-        gunTextures[i] = SDL_LoadBMP(fileName.c_str());
-        if (!gunTextures[i]) {
-            std::cerr << "Failed to load UI texture! SDL_Error: " << SDL_GetError() << std::endl;
-        }
-    }
-    // Face UI
-    for (int i = 0; i < numFaces; i++) {
-        std::string fileName = "ui/face_" + std::to_string(i) + ".bmp";
-        faceTextures[i] = SDL_LoadBMP(fileName.c_str());
-        if (!faceTextures[i]) {
-            std::cerr << "Failed to load UI texture! SDL_Error: " << SDL_GetError() << std::endl;
+        int x = (int)(i % width), y = (int)(i / width);
+        left = std::min(left, x);
+        right = std::max(right, x);
+        top = std::min(top, y);
+        bottom = std::max(bottom, y);
+        for (int shift = 0; shift < 32; shift += 8)
+        {
+            largest = std::max(largest, std::abs((int)((expected[i] >> shift) & 0xFF) - (int)((actual[i] >> shift) & 0xFF)));
         }
     }
 
-    // Audio
-    if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048) < 0)
+    if (differing > 0)
     {
-        printf("SDL_mixer could not initialize! SDL_mixer Error: %s\n", Mix_GetError());
+        printf("  frame %d differs from the reference in %d pixels, within (%d,%d)-(%d,%d), largest channel difference %d\n",
+            frame, differing, left, top, right, bottom, largest);
+        printf("  first at (%d,%d), expected %08X, got %08X\n", (int)(first % width), (int)(first / width), expected[first], actual[first]);
     }
+    return differing;
+}
 
-    music = Mix_LoadMUS("audio/music/e1m1.wav");
-    if (music == NULL)
+// Replays a recording headlessly with the dummy video driver and checks every frame against the
+// hash it was recorded with. Optionally keeps the frames, or compares them pixel by pixel with
+// frames kept by an earlier replay.
+int runReplay(const std::string& path, const std::string& saveFramesPath, const std::string& comparePath)
+{
+    Recording recording;
+    if (!loadRecording(path, recording)) return 1;
+
+    // Draw exactly as the recorded run did, at a fixed scale
+    renderScale = recording.renderScale;
+    maxRenderScale = std::max(maxRenderScale, renderScale);
+    setResolution(recording.width, recording.height);
+    upscaleFilter = recording.upscale == UPSCALE_NEAREST ? UPSCALE_NEAREST : UPSCALE_BILINEAR;
+    defaultFloorTexture = recording.floorTexture;
+    defaultCeilingTexture = recording.ceilingTexture;
+    maxRayDistance = recording.maxRayDistance;
+    resolutionController.setTarget(0);
+
+    SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+    if (SDL_Init(SDL_INIT_VIDEO) < 0)
     {
-        printf("Failed to load music! SDL_mixer Error: %s\n", Mix_GetError());
+        printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
+        return 1;
     }
 
-    fire = Mix_LoadWAV("audio/pew.wav");
-    if (fire == NULL)
+    window = SDL_CreateWindow("Replay", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, screenWidth, screenHeight, 0);
+    if (window == NULL)
     {
-        printf("Failed to load sound effect! SDL_mixer Error: %s\n", Mix_GetError());
+        printf("Window could not be created! SDL_Error: %s\n", SDL_GetError());
+        SDL_Quit();
+        return 1;
     }
+    screenSurface = SDL_GetWindowSurface(window);
+    createRenderTarget();
+    createLayers();
+    presentChain.start(presentBuffers);
 
-    font = TTF_OpenFont("font/VCR_OSD_MONO_1.001.ttf", 36);
-    if (font == NULL)
+    assets.start();
+    preloadMapTextures();
+    loadMedia();
+    if (TTF_Init() == -1) printf("SDL_ttf could not initialize! SDL_ttf Error: %s\n", TTF_GetError());
+    else loadFonts(); // The HUD counters are part of every frame
+    if (!loadMap(recording.map))
     {
-        printf("Failed to load font! SDL_ttf Error: %s\n", TTF_GetError());
+        printf("Could not load %s, the map of %s\n", recording.map.c_str(), path.c_str());
+        presentChain.stop();
+        assets.stop();
+        renderPool.stop();
+        freeRenderSurfaces();
+        SDL_DestroyWindow(window);
+        SDL_Quit();
+        return 1;
     }
-}
-
-void renderUI()
-{   
-    Uint32 colorKey = SDL_MapRGB(gunTextures[gunTexture]->format, 0x00, 0x00, 0x00); // Black color
-    SDL_SetColorKey(gunTextures[gunTexture], SDL_TRUE, colorKey);
-
-    //gunOffsetY = abs(gunOffsetX / 3);
-    gunOffsetY = ((1.0f/200.0f) * (gunOffsetX * gunOffsetX));
 
-    SDL_Rect gunRect = { screenWidth / 2 - (192/2) + gunOffsetX, 300 + gunOffsetY, 0, 0 };
-    SDL_BlitSurface(gunTextures[gunTexture], NULL, screenSurface, &gunRect);
+    std::ofstream savedFrames;
+    std::ifstream referenceFrames;
+    Uint32 frameSize[2] = { (Uint32)screenWidth, (Uint32)screenHeight };
+    if (!saveFramesPath.empty())
+    {
+        savedFrames.open(saveFramesPath, std::ios::binary);
+        if (!savedFrames.is_open()) printf("Could not open %s for writing\n", saveFramesPath.c_str());
+        savedFrames.write(frameFileMagic, sizeof(frameFileMagic));
+        savedFrames.write((const char*)frameSize, sizeof(frameSize));
+    }
+    if (!comparePath.empty())
+    {
+        referenceFrames.open(comparePath, std::ios::binary);
+        char magic[4] = {};
+        Uint32 referenceSize[2] = {};
+        referenceFrames.read(magic, sizeof(magic));
+        referenceFrames.read((char*)referenceSize, sizeof(referenceSize));
+        if (!referenceFrames || memcmp(magic, frameFileMagic, sizeof(magic)) != 0 || memcmp(referenceSize, frameSize, sizeof(frameSize)) != 0)
+        {
+            printf("%s holds no frames of this size, nothing to compare with\n", comparePath.c_str());
+            referenceFrames.close();
+        }
+    }
 
-    //SDL_FillRect(screenSurface, UIBase, SDL_MapRGB(screenSurface->format, 0x14, 0x23, 0x14));
-    SDL_Rect uibgRect = { 0, renderHeight, screenWidth, screenHeight - renderHeight };
-    SDL_BlitSurface(uibg, NULL, screenSurface, &uibgRect);
+    simulation.useManualClock(recordingClockRate);
+    simulation.reset(captureGameState());
 
-    SDL_SetColorKey(faceTextures[faceTexture], SDL_TRUE, colorKey);
+    InputState input;
+    GameState previousState;
+    GameState nextState;
+    bool done = false;
+    Uint64 clock = 0;
 
-    SDL_Rect faceRect = { screenWidth / 2 - 72, screenHeight-160, 0, 0};
-    SDL_BlitSurface(faceTextures[faceTexture], NULL, screenSurface, &faceRect); 
+    int count = (int)recording.frames.size();
+    int hashMismatches = 0, firstHashMismatch = -1;
+    int pixelMismatches = 0, comparedFrames = 0;
+    std::vector<double> frameTimes;
+    frameTimes.reserve(count);
+    std::vector<Uint32> pixels;
+    std::vector<Uint32> expected;
 
-    // THIS CAUSES A MEMORY LEAK
-    /*
-    SDL_Color textColor = { 255, 0, 0 };
+    for (int f = 0; f < count; f++)
+    {
+        const RecordedFrame& frame = recording.frames[f];
+        clock += frame.micros;
+        simulation.setTime(clock);
 
-    SDL_Rect* ammoTextRect = new SDL_Rect{ 400, 500, 0, 0 };
-    SDL_Surface* ammoTextSurface = TTF_RenderText_Solid(font, "AMMO: 100", textColor);
+        beginFrame();
 
-    SDL_BlitSurface(ammoTextSurface, NULL, screenSurface, ammoTextRect);
-    */
-}
+        Uint64 inputStart = SDL_GetPerformanceCounter();
+        for (const RecordedEvent& recorded : frame.events)
+        {
+            SDL_Event event;
+            memset(&event, 0, sizeof(event));
+            event.type = recorded.type;
+            event.key.keysym.sym = recorded.key;
+            handleEvent(event, input, done);
+        }
+        simulation.setInput(input);
+        input.shots = 0;
+        recordStage(STAGE_INPUT, inputStart);
 
-void shoot()
-{
-    if (canFire) 
-    {
-        canFire = false;
+        {
+            ScopedTimer timer(STAGE_SIMULATE);
 
-        gunTexture = 1;
-        Mix_PlayChannel(-1, fire, 0); 
+            simulation.advance();
+            double alpha = simulation.snapshot(previousState, nextState);
+            applyGameState(previousState, nextState, alpha);
+        }
 
-        double rayDirX = dirX;
-        double rayDirY = dirY;
-        double rayPosX = posX;
-        double rayPosY = posY;
+        Update();
 
-        int hit = 0;
-        int istep = 0;
+        endFrame();
+        frameTimes.push_back(currentFrame.frameMs);
 
-        while (hit == 0)
+        captureFrame(frameSurface, pixels);
+        if (hashPixels(pixels) != frame.hash && hashMismatches++ == 0) firstHashMismatch = f;
+        if (savedFrames.is_open()) savedFrames.write((const char*)pixels.data(), pixels.size() * sizeof(Uint32));
+        if (referenceFrames.is_open())
         {
-            rayPosX += rayDirX;
-            rayPosY += rayDirY;
-
-            for (int i = 0; i < numSprites; i++)
-            {
-                if ((int)rayPosX == sprite[i].x - 0.5f && (int)rayPosY == sprite[i].y - 0.5f)
-                {
-                    if (sprite[i].texture == spriteTextures[1]) sprite[i].texture = spriteTextures[8];
-                    //printf("Hit sprite\n");
-                    hit = 1;
-                }
-            }
-            if (worldMap[(int)floor(rayPosX)][(int)floor(rayPosY)] != 0)
+            expected.resize(pixels.size());
+            if (!referenceFrames.read((char*)expected.data(), expected.size() * sizeof(Uint32)))
             {
-                //worldMap[(int)floor(rayPosX)][(int)floor(rayPosY)] = 0;
-
-                //printf("Hit wall\n");
-                hit = 1;
+                printf("  the reference ends after %d frames\n", comparedFrames);
+                referenceFrames.close();
+                continue;
             }
-                
-            if (istep > 100) hit = 1;
-            istep++;
-        }  
+            comparedFrames++;
+            if (expected != pixels && pixelMismatches++ == 0) reportDifference(f, expected, pixels, screenWidth);
+        }
     }
-}
 
-SDL_Rect* floorRect = new SDL_Rect{ 0, renderHeight / 2, screenWidth, renderHeight / 2 };
+    presentChain.stop();
 
-void Update(double deltaTime)
-{
-    // Clear the screen
-    SDL_FillRect(screenSurface, NULL, SDL_MapRGB(screenSurface->format, 0x00, 0x00, 0x00));
-
-    // Create the floor
-    SDL_FillRect(screenSurface, floorRect, SDL_MapRGB(screenSurface->format, 0x12, 0x12, 0x12));
+    double totalTime = 0;
+    for (double time : frameTimes) totalTime += time;
+    std::vector<double> sorted = frameTimes;
+    std::sort(sorted.begin(), sorted.end());
 
-    // RAYCAST
-    for (int x = 0; x < screenWidth; x++)
+    printf("Replay: %d frames of %s at %dx%d, %d thread(s), %s DDA, %d present buffer(s)\n", count, path.c_str(), screenWidth, viewHeight, renderPool.threadCount(), rayTracerName(), presentBuffers);
+    if (count > 0)
     {
-        double cameraX = 2 * x / (double)screenWidth - 1;
-        double rayDirX = dirX + planeX * cameraX;
-        double rayDirY = dirY + planeY * cameraX;
-
-        int mapX = int(posX);
-        int mapY = int(posY);
-
-        double sideDistX;
-        double sideDistY;
+        printf("  frames/sec   %10.1f\n", count * 1000.0 / totalTime);
+        printf("  frame p50    %10.3f ms\n", sorted[(count - 1) / 2]);
+        printf("  frame p99    %10.3f ms\n", sorted[(int)((count - 1) * 0.99)]);
+    }
+    if (hashMismatches == 0) printf("  every frame matches its recorded hash\n");
+    else printf("  %d frame(s) differ from their recorded hash, the first is frame %d\n", hashMismatches, firstHashMismatch);
+    if (!comparePath.empty()) printf("  %d of %d frame(s) differ from %s\n", pixelMismatches, comparedFrames, comparePath.c_str());
+    if (savedFrames.is_open()) printf("  saved %d frames to %s\n", count, saveFramesPath.c_str());
 
-        double deltaDistX = (rayDirX == 0) ? 1e30 : std::abs(1 / rayDirX);
-        double deltaDistY = (rayDirY == 0) ? 1e30 : std::abs(1 / rayDirY);
+    writeProfile();
 
-        double perpWallDist;
+    assets.stop();
+    renderPool.stop();
+    freeRenderSurfaces();
+    SDL_DestroyWindow(window);
+    SDL_Quit();
 
-        int stepX;
-        int stepY;
+    return (hashMismatches > 0 || pixelMismatches > 0) ? 1 : 0;
+}
 
-        int hit = 0;
-        int side;
+int main(int argc, char* args[])
+{
+    SDL_Event event;
 
-        if (rayDirX < 0)
-        {
-            stepX = -1;
-            sideDistX = (posX - mapX) * deltaDistX;
-        }
-        else
+    // Command line
+    int threadCount = SDL_GetCPUCount();
+    std::string ddaPreference = "auto";
+    std::string bundlePath = "assets.pak";
+    int benchFrames = 0;
+    int benchEntities = 0;
+    int benchViews = 0;
+    int benchViewWidth = 160;
+    int benchViewHeight = 120;
+    bool selfTest = false;
+    int width = screenWidth;
+    int height = viewHeight;
+    double scale = renderScale;
+    bool simThread = false;
+    std::string recordPath;
+    std::string replayPath;
+    std::string saveFramesPath;
+    std::string comparePath;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = args[i];
+        if (arg == "--threads" && i + 1 < argc) threadCount = atoi(args[++i]);
+        else if (arg == "--dda" && i + 1 < argc) ddaPreference = args[++i];
+        else if (arg == "--profile-csv" && i + 1 < argc) profileCsvPath = args[++i];
+        else if (arg == "--profile-trace" && i + 1 < argc) profileTracePath = args[++i];
+        else if (arg == "--max-ray-distance" && i + 1 < argc) maxRayDistance = atof(args[++i]);
+        else if (arg == "--floor-texture" && i + 1 < argc) defaultFloorTexture = atoi(args[++i]);
+        else if (arg == "--ceiling-texture" && i + 1 < argc) defaultCeilingTexture = atoi(args[++i]);
+        else if (arg == "--resolution" && i + 1 < argc) sscanf(args[++i], "%dx%d", &width, &height);
+        else if (arg == "--render-scale" && i + 1 < argc) scale = atof(args[++i]);
+        else if (arg == "--max-render-scale" && i + 1 < argc) maxRenderScale = atof(args[++i]);
+        else if (arg == "--sim-thread") simThread = true;
+        else if (arg == "--full-redraw") fullRedraw = true;
+        else if (arg == "--present-buffers" && i + 1 < argc) presentBuffers = atoi(args[++i]);
+        else if (arg == "--target-frame-ms" && i + 1 < argc) resolutionController.setTarget(atof(args[++i]));
+        else if (arg == "--upscale" && i + 1 < argc)
         {
-            stepX = 1;
-            sideDistX = (mapX + 1.0 - posX) * deltaDistX;
+            std::string filter = args[++i];
+            if (filter == "nearest") upscaleFilter = UPSCALE_NEAREST;
+            else if (filter == "bilinear") upscaleFilter = UPSCALE_BILINEAR;
+            else printf("Unknown upscale filter %s, using bilinear\n", filter.c_str());
         }
-        if (rayDirY < 0)
+        else if (arg == "--convert" && i + 1 < argc)
         {
-            stepY = -1;
-            sideDistY = (posY - mapY) * deltaDistY;
+            std::string input = args[++i];
+            std::string output;
+            if (i + 1 < argc && args[i + 1][0] != '-') output = args[++i];
+            return convertMap(input, output);
         }
-        else
+        else if (arg == "--bundle" && i + 1 < argc) bundlePath = args[++i];
+        else if (arg == "--record" && i + 1 < argc) recordPath = args[++i];
+        else if (arg == "--replay" && i + 1 < argc) replayPath = args[++i];
+        else if (arg == "--save-frames" && i + 1 < argc) saveFramesPath = args[++i];
+        else if (arg == "--compare" && i + 1 < argc) comparePath = args[++i];
+        else if (arg == "--pack")
         {
-            stepY = 1;
-            sideDistY = (mapY + 1.0 - posY) * deltaDistY;
+            std::string output = "assets.pak";
+            if (i + 1 < argc && args[i + 1][0] != '-') output = args[++i];
+            return packAssets(output);
         }
-
-        int distfade = 0;
-
-        // DDA
-        while (hit == 0)
+        else if (arg == "--bench")
         {
-            if (distfade < 255) distfade += 10; // Higher value = view range shorter / 'darker room'
-            if (sideDistX < sideDistY)
-            {
-                sideDistX += deltaDistX;
-                mapX += stepX;
-                side = 0;
-            }
-            else
-            {
-                sideDistY += deltaDistY;
-                mapY += stepY;
-                side = 1;
-            }
-
-            if (worldMap[mapX][mapY] > 0)
-            {
-                hit = worldMap[mapX][mapY];
-                if (hit >= wallTypes) hit = 1;
-            }
+            benchFrames = 300;
+            if (i + 1 < argc && isdigit((unsigned char)args[i + 1][0])) benchFrames = atoi(args[++i]);
         }
-
-        // Door?
-        if (hit == 9)
+        else if (arg == "--bench-entities")
         {
-            if (side == 0)
-            {
-                sideDistX += deltaDistX / 2;
-
-                if (worldMap[mapX][mapY] != 9)
-                {
-                    sideDistX -= deltaDistX / 2;
-                }
-            }
-            else
-            {
-                sideDistY += deltaDistY / 2;
-
-                if (worldMap[mapX][mapY] != 9)
-                {
-                    sideDistY -= deltaDistY / 2;
-                }
-            }
+            benchEntities = 10000;
+            if (i + 1 < argc && isdigit((unsigned char)args[i + 1][0])) benchEntities = atoi(args[++i]);
         }
-
-        if (side == 0) perpWallDist = (sideDistX - deltaDistX);
-        else           perpWallDist = (sideDistY - deltaDistY);
-
-        int lineHeight = (int)(renderHeight / perpWallDist);
-
-        int drawStart = -lineHeight / 2 + renderHeight / 2;
-        if (drawStart < 0) drawStart = 0;
-        int drawEnd = lineHeight / 2 + renderHeight / 2;
-        if (drawEnd >= renderHeight) drawEnd = renderHeight - 1;
-
-        double wallX; // Exactly where the wall was hit
-        if (side == 0) wallX = posY + perpWallDist * rayDirY;
-        else           wallX = posX + perpWallDist * rayDirX;
-        wallX -= floor((wallX));
-
-        double verticleScale = (double)lineHeight / (double)wallTextureSize;
-        int sampleX = (int)floor((wallX * wallTextureSize)) % wallTextureSize;
-
-        for (int y = 0; y < lineHeight; y++)
+        else if (arg == "--bench-views")
         {
-            if (y + (renderHeight / 2) - (lineHeight / 2) > renderHeight) continue;
-            if (y + (renderHeight / 2) - (lineHeight / 2) < 0) continue;
-            int sampleY = (int)floor(y / verticleScale);
-
-            SDL_Color rgb = getPixelColor(wallTextures[hit], sampleX, sampleY);
-            if (rgb.r - distfade < 0) rgb.r = 0;
-            else rgb.r -= distfade;
-            if (rgb.g - distfade < 0) rgb.g = 0;
-            else rgb.g -= distfade;
-            if (rgb.b - distfade < 0) rgb.b = 0;
-            else rgb.b -= distfade;
-
-            if (side == 1)
-            {
-                rgb.r = rgb.r >> 1;
-                rgb.g = rgb.g >> 1;
-                rgb.b = rgb.b >> 1;
-            }
-            setPixel(screenSurface, x, y + (renderHeight / 2) - (lineHeight / 2), SDL_MapRGB(screenSurface->format, rgb.r, rgb.g, rgb.b));
+            benchViews = 64;
+            if (i + 1 < argc && isdigit((unsigned char)args[i + 1][0])) benchViews = atoi(args[++i]);
         }
-
-        ZBuffer[x] = perpWallDist;
+        else if (arg == "--selftest") selfTest = true;
+        else if (arg == "--view-size" && i + 1 < argc) sscanf(args[++i], "%dx%d", &benchViewWidth, &benchViewHeight);
     }
 
-    // SPRITECAST
-
-    // Sprite sorting
-    for (int i = 0; i < numSprites; i++)
+    if (ddaPreference != "auto" && ddaPreference != "scalar" && ddaPreference != "sse41" && ddaPreference != "avx2")
     {
-        spriteOrder[i] = i;
-        spriteDistance[i] = ((posX - sprite[i].x) * (posX - sprite[i].x) + (posY - sprite[i].y) * (posY - sprite[i].y)); //sqrt not taken, unneeded
+        printf("Unknown DDA %s, use auto, scalar, sse41 or avx2\n", ddaPreference.c_str());
+        return 1;
     }
-    sortSprites(spriteOrder, spriteDistance, numSprites);
-    for (int i = 0; i < numSprites; i++)
+    if (width < 1 || height < 1)
     {
-        double spriteX = sprite[spriteOrder[i]].x - posX;
-        double spriteY = sprite[spriteOrder[i]].y - posY;
-
-        double invDet = 1.0 / (planeX * dirY - dirX * planeY);
-
-        double transformX = invDet * (dirY * spriteX - dirX * spriteY);
-        double transformY = invDet * (-planeY * spriteX + planeX * spriteY);
-
-        int spriteScreenX = int((screenWidth / 2) * (1 + transformX / transformY));
-
-        int spriteHeight = abs(int(renderHeight / (transformY)));
+        printf("Invalid resolution %dx%d\n", width, height);
+        return 1;
+    }
+    if (presentBuffers < 1 || presentBuffers > PresentChain::maxBuffers)
+    {
+        printf("Present buffers go from 1 to %d\n", PresentChain::maxBuffers);
+        return 1;
+    }
+    if (defaultFloorTexture < 0 || defaultFloorTexture >= wallTypes || defaultCeilingTexture < 0 || defaultCeilingTexture >= wallTypes)
+    {
+        printf("Floor and ceiling textures go from 1 to %d, 0 is flat\n", wallTypes - 1);
+        return 1;
+    }
+    if (scale < minRenderScale || maxRenderScale < minRenderScale)
+    {
+        printf("Render scale can't go below %.2f\n", minRenderScale);
+        return 1;
+    }
+    // A fixed scale above 1 supersamples, the controller may only drop below it
+    maxRenderScale = std::max(maxRenderScale, scale);
+    renderScale = scale;
+    setResolution(width, height);
+    if (renderScale != 1.0 || resolutionController.enabled()) printf("Rendering at %dx%d, scale %.2f\n", renderWidth, renderHeight, renderScale);
 
-        int drawStartY = -spriteHeight / 2 + renderHeight / 2;
-        if (drawStartY < 0) drawStartY = 0;
-        int drawEndY = spriteHeight / 2 + renderHeight / 2;
-        if (drawEndY >= renderHeight) drawEndY = renderHeight - 1;
+    // Without a bundle every asset comes from its loose file
+    std::ifstream bundleFile(bundlePath, std::ios::binary);
+    if (bundleFile.is_open())
+    {
+        bundleFile.close();
+        if (assetBundle.open(bundlePath)) printf("Using asset bundle %s, %d assets\n", bundlePath.c_str(), assetBundle.assetCount());
+    }
 
-        int spriteWidth = abs(int(renderHeight / (transformY)));
-        int drawStartX = -spriteWidth / 2 + spriteScreenX;
-        if (drawStartX < 0) drawStartX = 0;
-        int drawEndX = spriteWidth / 2 + spriteScreenX;
-        if (drawEndX >= screenWidth) drawEndX = screenWidth - 1;
+    renderPool.start(threadCount);
+    selectRayTracer(ddaPreference);
+    selectEntityUpdater(ddaPreference);
+    printf("Rendering with %d thread(s), %s DDA\n", renderPool.threadCount(), rayTracerName());
 
-        for (int slice = drawStartX; slice < drawEndX; slice++)
+    if (selfTest) return runSelfTest();
+    if (benchViews > 0)
+    {
+        if (benchViewWidth < 16 || benchViewHeight < 16)
         {
-            int texX = int(256 * (slice - (-spriteWidth / 2 + spriteScreenX)) * texWidth / spriteWidth) / 256;
-
-            if (transformY > 0 && slice > 0 && slice < screenWidth && transformY < ZBuffer[slice])
-                for (int y = drawStartY; y < drawEndY; y++)
-                {
-                    int d = (y) * 256 - renderHeight * 128 + spriteHeight * 128; // 256 and 128 factors avoids using floats
-                    int texY = ((d * texHeight) / spriteHeight) / 256;
-                    SDL_Color color = getPixelColor(sprite[spriteOrder[i]].texture, texX / 2, texY / 2);
-                    
-                    if (!SDL_MapRGB(screenSurface->format, color.r, color.b, color.g) == 0x00)
-                    {
-                        setPixel(screenSurface, slice, y, SDL_MapRGB(screenSurface->format, color.r, color.g, color.b));
-                    }
-                }
+            printf("Invalid view size %dx%d, views are at least 16x16\n", benchViewWidth, benchViewHeight);
+            return 1;
         }
+        return runViewBenchmark(benchViews, benchViewWidth, benchViewHeight, benchEntities);
     }
-
-    renderUI();
-
-    SDL_UpdateWindowSurface(window);
-}
-
-int main(int argc, char* args[])
-{
-    bool movingForward = false;
-    bool movingBackward = false;
-    bool turningRight = false;
-    bool turningLeft = false;
-
-    bool moving = false;
-    
-    SDL_Event event;
+    if (benchEntities > 0 && benchFrames == 0) benchFrames = 300;
+    if (benchFrames > 0) return runBenchmark(benchFrames, benchEntities);
+    if (!replayPath.empty()) return runReplay(replayPath, saveFramesPath, comparePath);
 
     // Init
     if (SDL_Init(SDL_INIT_VIDEO) < 0)
@@ -601,10 +6241,13 @@ int main(int argc, char* args[])
         else
         {
             screenSurface = SDL_GetWindowSurface(window);
+            createRenderTarget();
+            createLayers();
             
             SDL_FillRect(screenSurface, NULL, SDL_MapRGB(screenSurface->format, 0x00, 0x00, 0x00));
 
             SDL_UpdateWindowSurface(window);
+            presentChain.start(presentBuffers);
         }
     }
     if (TTF_Init() == -1)
@@ -612,14 +6255,52 @@ int main(int argc, char* args[])
         printf("SDL_ttf could not initialize! SDL_ttf Error: %s\n", TTF_GetError());
     }
 
-    loadMap("maps/2.rmap");
+    // The level textures decode in the background while the UI, audio and fonts load here
+    if (screenSurface)
+    {
+        assets.start();
+        preloadMapTextures();
+    }
     loadMedia();
+    loadAudioAndFont();
+    const std::string startMap = "maps/2.rmap";
+    if (!loadMap(startMap))
+    {
+        printf("Could not load %s\n", startMap.c_str());
+        presentChain.stop();
+        assets.stop();
+        renderPool.stop();
+        freeRenderSurfaces();
+        SDL_DestroyWindow(window);
+        SDL_Quit();
+        return 1;
+    }
 
     //Mix_PlayMusic(music, -1);
 
+    // A recording has to replay tick for tick, so the simulation runs on the recorded frame times
+    // on this thread and the render scale stays put
+    if (!recordPath.empty() && recorder.open(recordPath, startMap))
+    {
+        if (simThread || resolutionController.enabled()) printf("Recording runs the simulation on the main thread at a fixed render scale\n");
+        simThread = false;
+        resolutionController.setTarget(0);
+        simulation.useManualClock(recordingClockRate);
+    }
+    Uint64 recordClock = 0;
+    std::vector<Uint32> recordPixels;
+
+    // The simulation starts from the loaded level and runs on its own clock from here
+    simulation.reset(captureGameState());
+    if (simThread) simulation.start();
+
+    InputState input;
+    GameState previousState;
+    GameState nextState;
+    Uint32 shotsPlayed = 0;
+
     Uint64 NOW = SDL_GetPerformanceCounter();
     Uint64 LAST = 0;
-    double deltaTime = 0;
 
     // Main loop
     bool done = false;
@@ -627,127 +6308,74 @@ int main(int argc, char* args[])
     {
         LAST = NOW;
         NOW = SDL_GetPerformanceCounter();
-        deltaTime = ((NOW - LAST) * 3 / (double)SDL_GetPerformanceFrequency());
 
-        Update(deltaTime);
+        // Whole microseconds, the resolution the recording keeps
+        Uint64 frameMicros = 0;
+        if (recorder.isOpen())
+        {
+            if (LAST != 0) frameMicros = (NOW - LAST) * recordingClockRate / SDL_GetPerformanceFrequency();
+            recordClock += frameMicros;
+            simulation.setTime(recordClock);
+        }
+
+        beginFrame();
 
-        double oldDirX = dirX;
-        double oldPlaneX = planeX;
+        Uint64 inputStart = SDL_GetPerformanceCounter();
 
         // Input
         while (SDL_PollEvent(&event)) {
-            if (event.type == SDL_KEYDOWN)
-            {
-                /* Check the SDLKey values and move change the coords */
-                switch (event.key.keysym.sym) {
-                case SDLK_LEFT:
-                    turningLeft = true;
-                    break;
-                case SDLK_RIGHT:
-                    turningRight = true;
-                    break;
-                case SDLK_UP:
-                    movingForward = true;
-                    moving = true;
-                    break;
-                case SDLK_DOWN:
-                    movingBackward = true;
-                    moving = true;
-                    break;
-                case SDLK_LCTRL:
-                    shoot();
-                    break;
-                case SDLK_ESCAPE:
-                    done = true;
-                    break;
-                default:
-                    break;
-                }
-            }
-            if (event.type == SDL_KEYUP)
-            {
-                /* Check the SDLKey values and move change the coords */
-                switch (event.key.keysym.sym) {
-                case SDLK_LEFT:
-                    turningLeft = false;
-                    break;
-                case SDLK_RIGHT:
-                    turningRight = false;
-                    break;
-                case SDLK_UP:
-                    movingForward = false;
-                    moving = false;
-                    break;
-                case SDLK_DOWN:
-                    movingBackward = false;
-                    moving = false;
-                    break;
-                default:
-                    break;
-                }
-            }
-            if (event.type == SDL_QUIT) done = true;
+            if (recorder.isOpen()) recorder.event(event);
+            handleEvent(event, input, done);
         }
         
-        // Applying input
-        if (movingForward)
-        {
-            if (worldMap[int(posX + dirX * moveSpeed*4 * deltaTime)][int(posY)] == 0) posX += dirX * moveSpeed * deltaTime;
-            if (worldMap[int(posX)][int(posY + dirY * moveSpeed*4 * deltaTime)] == 0) posY += dirY * moveSpeed * deltaTime;
-        }
-        if (movingBackward)
-        {
-            if (worldMap[int(posX - dirX * moveSpeed*4 * deltaTime)][int(posY)] == 0) posX -= dirX * moveSpeed * deltaTime;
-            if (worldMap[int(posX)][int(posY - dirY * moveSpeed*4 * deltaTime)] == 0) posY -= dirY * moveSpeed * deltaTime;
-        }
-        if (turningRight)
-        {
-            dirX = dirX * cos(-rotSpeed * deltaTime) - dirY * sin(-rotSpeed * deltaTime);
-            dirY = oldDirX * sin(-rotSpeed * deltaTime) + dirY * cos(-rotSpeed * deltaTime);
-            planeX = planeX * cos(-rotSpeed * deltaTime) - planeY * sin(-rotSpeed * deltaTime);
-            planeY = oldPlaneX * sin(-rotSpeed * deltaTime) + planeY * cos(-rotSpeed * deltaTime);
-        }
-        if (turningLeft)
-        {
-            dirX = dirX * cos(rotSpeed * deltaTime) - dirY * sin(rotSpeed * deltaTime);
-            dirY = oldDirX * sin(rotSpeed * deltaTime) + dirY * cos(rotSpeed * deltaTime);
-            planeX = planeX * cos(rotSpeed * deltaTime) - planeY * sin(rotSpeed * deltaTime);
-            planeY = oldPlaneX * sin(rotSpeed * deltaTime) + planeY * cos(rotSpeed * deltaTime);
-        }
-        if (moving)
+        simulation.setInput(input);
+        input.shots = 0;
+        recordStage(STAGE_INPUT, inputStart);
+
         {
-            if (gunSwayRight)
-            {
-                gunOffsetX += 300 * deltaTime;
-                if (gunOffsetX > 80)
-                {
-                    gunSwayRight = false;
-                }
-            }
-            else
-            {
-                gunOffsetX -= 300 * deltaTime;
-                if (gunOffsetX < -80)
-                {
-                    gunSwayRight = true;
-                }
-            }
+            ScopedTimer timer(STAGE_SIMULATE);
+
+            if (!simulation.threaded()) simulation.advance();
+            double alpha = simulation.snapshot(previousState, nextState);
+            applyGameState(previousState, nextState, alpha);
+
+            for (; shotsPlayed != nextState.shotsFired; shotsPlayed++) Mix_PlayChannel(-1, fire, 0);
         }
-        else
+
+        bool drawn = Update();
+
+        endFrame();
+
+        if (recorder.isOpen())
         {
-            if (gunOffsetX > 0) gunOffsetX -= 300 * deltaTime;
-            if (gunOffsetX < 0) gunOffsetX += 300 * deltaTime;
+            captureFrame(frameSurface, recordPixels);
+            recorder.frame(frameMicros, hashPixels(recordPixels));
         }
 
-        if (!canFire) fireCooldown -= deltaTime;
-        if (fireCooldown <= 0)
+        if (drawn && resolutionController.enabled()) setRenderScale(resolutionController.update(currentFrame.frameMs, renderScale));
+
+        // Nothing on screen changed, put the last frame up and sleep until there's input or a tick
+        // could have changed something
+        if (!drawn)
         {
-            canFire = true;
-            gunTexture = 0;
-            fireCooldown = 0.5f;
+            presentChain.flush();
+            SDL_WaitEventTimeout(NULL, 1000 / simTickRate);
         }
     }
 
+    if (recorder.isOpen())
+    {
+        printf("Recorded %d frames to %s\n", recorder.frameCount(), recordPath.c_str());
+        recorder.close();
+    }
+
+    simulation.stop();
+    presentChain.stop();
+    writeProfile();
+    assets.stop();
+    renderPool.stop();
+
+    freeRenderSurfaces();
     SDL_DestroyWindow(window);
     SDL_Quit();
 